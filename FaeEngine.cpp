@@ -5,6 +5,7 @@
 #include<sstream>
 #include<vector>
 #include <chrono>
+#include <ctime>
 #include <thread>
 
 //----------------------------------------------------------------
@@ -33,17 +34,17 @@ gstd::value func_clear(gstd::script_machine* machine, int argc, gstd::value cons
 
 gstd::value func_min(gstd::script_machine* machine, int argc, gstd::value const * argv)
 {
-	long double v1 = argv[0].as_real();
-	long double v2 = argv[1].as_real();
-	long double res = v1 <= v2 ? v1 : v2;
+	gstd::real_t v1 = argv[0].as_real();
+	gstd::real_t v2 = argv[1].as_real();
+	gstd::real_t res = v1 <= v2 ? v1 : v2;
 	return gstd::value(machine->get_engine()->get_real_type(), res);
 }
 
 gstd::value func_max(gstd::script_machine* machine, int argc, gstd::value const * argv)
 {
-	long double v1 = argv[0].as_real();
-	long double v2 = argv[1].as_real();
-	long double res = v1 >= v2 ? v1 : v2;
+	gstd::real_t v1 = argv[0].as_real();
+	gstd::real_t v2 = argv[1].as_real();
+	gstd::real_t res = v1 >= v2 ? v1 : v2;
 	return gstd::value(machine->get_engine()->get_real_type(), res);
 }
 
@@ -135,12 +136,17 @@ void RunSample(char* scriptName)
 
 	//--------------------------------
 	//create script engine
+	//compiled code is cached next to the script (script.fae -> script.faec)
 	gstd::script_type_manager typeManager;
-	gstd::script_engine engine(&typeManager, source.c_str(), func.size(), &func[0]);
+	std::string cacheName = std::string(scriptName) + "c";
+	gstd::script_engine engine(&typeManager, source.c_str(), func.size(), &func[0], cacheName);
 	ErrorHandle::CheckEngineError(engine);
 
 	//--------------------------------
 	//create script machine
+#if defined(__SCRIPT_H__COUNT_CODES)
+	std::clock_t started = std::clock();
+#endif
 	gstd::script_machine machine(&engine);
 	machine.run();
 	ErrorHandle::CheckMachineError(machine);
@@ -180,4 +186,12 @@ void RunSample(char* scriptName)
 			ErrorHandle::CheckMachineError(machine);
 		}
 	}
+
+#if defined(__SCRIPT_H__COUNT_CODES)
+	//--------------------------------
+	//codes run per second of processor time, for scripts that only run @Initialize
+	double seconds = static_cast<double>(std::clock() - started) / CLOCKS_PER_SEC;
+	std::cerr << machine.get_code_count() << " codes in " << seconds << " s, "
+		<< machine.get_code_count() / seconds / 1e6 << " million codes/s" << std::endl;
+#endif
 }
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include"ScriptEngine.hpp"
 #include<vector>
+#include<set>
+#include<algorithm>
 #include<cctype>
 #include<cstdio>
 #include<clocale>
 #include<cmath>
 #include<cassert>
+#include<cstring>
+#include<fstream>
+#include<sstream>
 
 #ifdef _MSC_VER
 #define for if(0);else for
@@ -13,19 +18,24 @@ namespace std
 	using::wcstombs;
 	using::mbstowcs;
 	using::isalpha;
-	using::fmodl;
-	using::powl;
+	using::fmod;
+	using::pow;
 	using::swprintf;
 	using::atof;
 	using::isdigit;
 	using::isxdigit;
-	using::floorl;
-	using::ceill;
-	using::fabsl;
+	using::floor;
+	using::ceil;
+	using::fabs;
 }
 
 #endif
 
+// Dispatch codes through a table of label addresses on compilers that support it
+#if defined(__GNUC__) || defined(__clang__)
+#define __SCRIPT_H__THREADED_DISPATCH
+#endif
+
 using namespace gstd;
 
 
@@ -92,7 +102,7 @@ public:
 	char const * current;
 	token_kind next;
 	std::string word;
-	long double real_value;
+	real_t real_value;
 	wchar_t char_value;
 	std::wstring string_value;
 	int line;
@@ -110,6 +120,51 @@ public:
 	void advance();
 };
 
+struct keyword
+{
+	char const * text;
+	token_kind kind;
+};
+
+static keyword const keywords[] =
+{
+	{ "events", tk_EVENTS }, { "for", tk_FOR }, { "break", tk_BREAK }, { "on", tk_ON }, { "reverse", tk_REVERSE }, { "else", tk_ELSE },
+	{ "function", tk_FUNCTION }, { "if", tk_IF }, { "in", tk_IN }, { "let", tk_LET }, { "var", tk_LET }, { "local", tk_LOCAL },
+	{ "loop", tk_LOOP }, { "real", tk_REAL }, { "return", tk_RETURN }, { "sub", tk_SUB }, { "task", tk_TASK }, { "this", tk_THIS },
+	{ "times", tk_TIMES }, { "while", tk_WHILE }, { "yield", tk_YIELD }, { "exit", tk_EXIT }
+};
+
+// Perfect hash of the keywords: no two of them share a slot, so a word is compared with one keyword at most
+static unsigned keyword_slot(char const * word, std::size_t length)
+{
+	return (length * 5 + static_cast < unsigned char > (word[0]) * 5 + static_cast < unsigned char > (word[length - 1])) & 63;
+}
+
+struct keyword_table
+{
+	keyword const * slots[64];
+
+	keyword_table()
+	{
+		for (int i = 0; i < 64; ++i)
+			slots[i] = NULL;
+		for (unsigned i = 0; i < sizeof(keywords) / sizeof(keyword); ++i)
+		{
+			unsigned slot = keyword_slot(keywords[i].text, std::strlen(keywords[i].text));
+			assert(slots[slot] == NULL);
+			slots[slot] = &keywords[i];
+		}
+	}
+
+	token_kind find(char const * word, std::size_t length) const
+	{
+		keyword const * k = slots[keyword_slot(word, length)];
+		return (k != NULL && std::strncmp(k->text, word, length) == 0 && k->text[length] == '\0') ? k->kind : tk_word;
+	}
+};
+
+static keyword_table const keyword_slots;
+
 void scanner::skip()
 {
 	//skip whitespace
@@ -352,12 +407,12 @@ void scanner::advance()
 		else if (std::isalpha(*current) || *current == '_')
 		{
 			next = tk_property;
-			word = "";
+			char const * begin = current;
 			do
 			{
-				word += *current;
 				++current;
 			} while (std::isalpha(*current) || *current == '_' || std::isdigit(*current));
+			word.assign(begin, current);
 		}
 		else
 		{
@@ -368,17 +423,14 @@ void scanner::advance()
 	case '\'':
 	case '\"':
 	{
-		std::string s;
 		char q = *current;
 		next = (q == '\"') ? tk_string : tk_char;
 		++current;
+		char const * begin = current;
 		while (*current != q)
-		{
-			s += *current;
 			++current;
-		}
+		string_value = to_wide(std::string(begin, current));
 		++current;
-		string_value = to_wide(s);
 		if (q == '\'')
 		{
 			if (string_value.size() == 1)
@@ -426,16 +478,16 @@ void scanner::advance()
 		if (std::isdigit(*current))
 		{
 			next = tk_real;
-			real_value = 0.0;
+			real_value = 0;
 			do
 			{
-				real_value = real_value * 10. + (*current - '0');
+				real_value = real_value * 10 + (*current - '0');
 				++current;
 			} while (std::isdigit(*current));
 			if (*current == '.' && std::isdigit(*(current + 1)))
 			{
 				++current;
-				long double d = 1;
+				real_t d = 1;
 				while (std::isdigit(*current))
 				{
 					d = d / 10;
@@ -446,56 +498,13 @@ void scanner::advance()
 		}
 		else if (std::isalpha(*current) || *current == '_')
 		{
-			next = tk_word;
-			word = "";
+			char const * begin = current;
 			do
 			{
-				word += *current;
 				++current;
 			} while (std::isalpha(*current) || *current == '_' || std::isdigit(*current));
-
-			if (word == "events")
-				next = tk_EVENTS;
-			else if (word == "for")
-				next = tk_FOR;
-			else if (word == "break")
-				next = tk_BREAK;
-			else if (word == "on")
-				next = tk_ON;
-			else if (word == "reverse")
-				next = tk_REVERSE;
-			else if (word == "else")
-				next = tk_ELSE;
-			else if (word == "function")
-				next = tk_FUNCTION;
-			else if (word == "if")
-				next = tk_IF;
-			else if (word == "in")
-				next = tk_IN;
-			else if (word == "let" || word == "var")
-				next = tk_LET;
-			else if (word == "local")
-				next = tk_LOCAL;
-			else if (word == "loop")
-				next = tk_LOOP;
-			else if (word == "real")
-				next = tk_REAL;
-			else if (word == "return")
-				next = tk_RETURN;
-			else if (word == "sub")
-				next = tk_SUB;
-			else if (word == "task")
-				next = tk_TASK;
-			else if (word == "this")
-				next = tk_THIS;
-			else if (word == "times")
-				next = tk_TIMES;
-			else if (word == "while")
-				next = tk_WHILE;
-			else if (word == "yield")
-				next = tk_YIELD;
-			else if (word == "exit")
-				next = tk_EXIT;
+			word.assign(begin, current);
+			next = keyword_slots.find(begin, current - begin);
 		}
 		else
 		{
@@ -506,6 +515,54 @@ void scanner::advance()
 
 /* operations */
 
+// Element-wise operations on two arrays of packed reals of the same length
+// Each kernel is a plain loop over contiguous reals so the compiler can vectorize it
+enum packed_operation
+{
+	po_add, po_subtract, po_multiply, po_divide, po_remainder, po_power
+};
+
+static bool packed_arithmetic(value const * argv, packed_operation operation, value & result)
+{
+	unsigned n = argv[0].length_as_array();
+	if (n == 0 || !argv[0].is_packed_reals() || !argv[1].is_packed_reals())
+		return false;
+
+	real_t const * a = argv[0].packed_reals();
+	real_t const * b = argv[1].packed_reals();
+	real_t * r;
+	result = value::make_packed_reals(argv[1].get_type(), n, r);
+
+	switch (operation)
+	{
+	case po_add:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = a[i] + b[i];
+		break;
+	case po_subtract:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = a[i] - b[i];
+		break;
+	case po_multiply:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = a[i] * b[i];
+		break;
+	case po_divide:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = a[i] / b[i];
+		break;
+	case po_remainder:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = std::fmod(a[i], b[i]);
+		break;
+	case po_power:
+		for (unsigned i = 0; i < n; ++i)
+			r[i] = std::pow(a[i], b[i]);
+		break;
+	}
+	return true;
+}
+
 value add(script_machine * machine, int argc, value const * argv)
 {
 	assert(argc == 2);
@@ -524,6 +581,8 @@ value add(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_add, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -554,6 +613,8 @@ value subtract(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_subtract, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -583,6 +644,8 @@ value multiply(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_multiply, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -612,6 +675,8 @@ value divide(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_divide, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -641,6 +706,8 @@ value remainder(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_remainder, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -651,13 +718,24 @@ value remainder(script_machine * machine, int argc, value const * argv)
 		return result;
 	}
 	else
-		return value(machine->get_engine()->get_real_type(), std::fmodl(argv[0].as_real(), argv[1].as_real()));
+		return value(machine->get_engine()->get_real_type(), std::fmod(argv[0].as_real(), argv[1].as_real()));
 }
 
 value negative(script_machine * machine, int argc, value const * argv)
 {
 	if (argv[0].get_type()->get_kind() == type_data::tk_array)
 	{
+		unsigned n = argv[0].length_as_array();
+		if (n > 0 && argv[0].is_packed_reals())
+		{
+			real_t const * a = argv[0].packed_reals();
+			real_t * r;
+			value result = value::make_packed_reals(argv[0].get_type(), n, r);
+			for (unsigned i = 0; i < n; ++i)
+				r[i] = -a[i];
+			return result;
+		}
+
 		value result;
 		for (unsigned i = 0; i < argv[0].length_as_array(); ++i)
 		{
@@ -685,6 +763,8 @@ value power(script_machine * machine, int argc, value const * argv)
 			return value();
 		}
 		value result;
+		if (packed_arithmetic(argv, po_power, result))
+			return result;
 		for (unsigned i = 0; i < argv[1].length_as_array(); ++i)
 		{
 			value v[2];
@@ -695,7 +775,7 @@ value power(script_machine * machine, int argc, value const * argv)
 		return result;
 	}
 	else
-	return value(machine->get_engine()->get_real_type(), std::powl(argv[0].as_real(), argv[1].as_real()));
+	return value(machine->get_engine()->get_real_type(), std::pow(argv[0].as_real(), argv[1].as_real()));
 }
 
 value compare(script_machine * machine, int argc, value const * argv)
@@ -708,8 +788,8 @@ value compare(script_machine * machine, int argc, value const * argv)
 		{
 		case type_data::tk_real:
 		{
-			long double a = argv[0].as_real();
-			long double b = argv[1].as_real();
+			real_t a = argv[0].as_real();
+			real_t b = argv[1].as_real();
 			r = (a == b) ? 0 : (a < b) ? -1 : 1;
 		}
 		break;
@@ -732,6 +812,29 @@ value compare(script_machine * machine, int argc, value const * argv)
 
 		case type_data::tk_array:
 		{
+			if (argv[0].is_packed_string() && argv[1].is_packed_string())
+			{
+				r = argv[0].compare_as_string(argv[1]);
+				break;
+			}
+
+			if (argv[0].is_packed_reals() && argv[1].is_packed_reals())
+			{
+				unsigned l = argv[0].length_as_array();
+				unsigned m = argv[1].length_as_array();
+				unsigned n = (l < m) ? l : m;
+				real_t const * a = argv[0].packed_reals();
+				real_t const * b = argv[1].packed_reals();
+				unsigned i = 0;
+				while (i < n && a[i] == b[i])
+					++i;
+				if (i < n)
+					r = (a[i] < b[i]) ? -1 : 1;
+				else
+					r = (l == m) ? 0 : (l < m) ? -1 : 1;
+				break;
+			}
+
 			for (unsigned i = 0; i < argv[0].length_as_array(); ++i)
 			{
 				if (i >= argv[1].length_as_array())
@@ -764,7 +867,7 @@ value compare(script_machine * machine, int argc, value const * argv)
 		default:
 			assert(false);
 		}
-		return value(machine->get_engine()->get_real_type(), static_cast < long double > (r));
+		return value(machine->get_engine()->get_real_type(), static_cast < real_t > (r));
 	}
 	else
 	{
@@ -844,7 +947,21 @@ value length(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	return value(machine->get_engine()->get_real_type(), static_cast < long double > (argv[0].length_as_array()));
+	return value(machine->get_engine()->get_real_type(), static_cast < long long > (argv[0].length_as_array()));
+}
+
+// Reads an array index, false when it has a fractional part
+// Indices held as integers skip the conversion from real
+static bool get_index(value const & v, long long & index)
+{
+	if (v.is_integer())
+	{
+		index = v.get_integer();
+		return index == static_cast < int > (index);
+	}
+	real_t r = v.as_real();
+	index = static_cast < int > (r);
+	return r == index;
 }
 
 value index(script_machine * machine, int argc, value const * argv)
@@ -857,9 +974,9 @@ value index(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	long double index = argv[1].as_real();
+	long long index;
 
-	if (index != static_cast < int > (index))
+	if (!get_index(argv[1], index))
 	{
 		machine->raise_error("Array index contains a decimal point.");
 		return value();
@@ -885,9 +1002,9 @@ value index_writable(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	long double index = argv[1].as_real();
+	long long index;
 
-	if (index != static_cast < int > (index))
+	if (!get_index(argv[1], index))
 	{
 		machine->raise_error("Array index contains a decimal point.");
 		return value();
@@ -899,7 +1016,7 @@ value index_writable(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	value const & result = argv[0].index_as_array(index);
+	value const & result = argv[0].index_as_array_writable(index);
 	result.unique();
 	return result;
 }
@@ -914,7 +1031,7 @@ value slice(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	long double index_1 = argv[1].as_real();
+	real_t index_1 = argv[1].as_real();
 
 	if (index_1 != static_cast < int > (index_1))
 	{
@@ -922,7 +1039,7 @@ value slice(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	long double index_2 = argv[2].as_real();
+	real_t index_2 = argv[2].as_real();
 
 	if (index_2 != static_cast < int > (index_2))
 	{
@@ -956,7 +1073,7 @@ value erase(script_machine * machine, int argc, value const * argv)
 		return value();
 	}
 
-	long double index_1 = argv[1].as_real();
+	real_t index_1 = argv[1].as_real();
 	double length = argv[0].length_as_array();
 
 	if (index_1 != static_cast < int > (index_1))
@@ -1030,36 +1147,36 @@ value concatenate(script_machine * machine, int argc, value const * argv)
 
 value round(script_machine * machine, int argc, value const * argv)
 {
-	long double r = std::floorl(argv[0].as_real() + 0.5);
+	real_t r = std::floor(argv[0].as_real() + static_cast < real_t > (0.5));
 	return value(machine->get_engine()->get_real_type(), r);
 }
 
 value truncate(script_machine * machine, int argc, value const * argv)
 {
-	long double r = argv[0].as_real();
-	r = (r > 0) ? std::floorl(r) : std::ceill(r);
+	real_t r = argv[0].as_real();
+	r = (r > 0) ? std::floor(r) : std::ceil(r);
 	return value(machine->get_engine()->get_real_type(), r);
 }
 
 value ceil(script_machine * machine, int argc, value const * argv)
 {
-	return value(machine->get_engine()->get_real_type(), std::ceill(argv[0].as_real()));
+	return value(machine->get_engine()->get_real_type(), std::ceil(argv[0].as_real()));
 }
 
 value floor(script_machine * machine, int argc, value const * argv)
 {
-	return value(machine->get_engine()->get_real_type(), std::floorl(argv[0].as_real()));
+	return value(machine->get_engine()->get_real_type(), std::floor(argv[0].as_real()));
 }
 
 value absolute(script_machine * machine, int argc, value const * argv)
 {
-	long double r = std::fabsl(argv[0].as_real());
+	real_t r = std::fabs(argv[0].as_real());
 	return value(machine->get_engine()->get_real_type(), r);
 }
 
 value pi(script_machine * machine, int argc, value const * argv)
 {
-	return value(machine->get_engine()->get_real_type(), (long double) 3.14159265358979323846);
+	return value(machine->get_engine()->get_real_type(), static_cast < real_t > (3.14159265358979323846L));
 }
 
 value assert_(script_machine * machine, int argc, value const * argv)
@@ -1071,6 +1188,20 @@ value assert_(script_machine * machine, int argc, value const * argv)
 	return value();
 }
 
+// Same number of frames as loop(n) { yield; }, without running the task in between
+value sleep_(script_machine * machine, int argc, value const * argv)
+{
+	assert(argc == 1);
+	// counts past the frame counter, infinity included, sleep for good; NaN does not sleep
+	real_t frames = std::ceil(argv[0].as_real());
+	unsigned long long const forever = std::numeric_limits < unsigned long long >::max();
+	if (frames >= static_cast < real_t > (forever))
+		machine->sleep(forever);
+	else if (frames > 0)
+		machine->sleep(static_cast < unsigned long long > (frames));
+	return value();
+}
+
 value obj_register_property(script_machine * machine, int argc, value const * argv)
 {
 	assert(argc == 3);
@@ -1078,7 +1209,7 @@ value obj_register_property(script_machine * machine, int argc, value const * ar
 	value o = argv[2];
 	if (o.get_type()->get_kind() != type_data::tk_object)
 		machine->raise_error("Cannot register property to non-object value.");
-	if (!o.register_property(argv[0].as_string(), argv[1]))
+	if (!o.register_property(machine->get_engine()->get_atoms().intern(argv[0].as_string()), argv[1]))
 		machine->raise_error("A property already exists with this name.");
 
 	return o;
@@ -1089,9 +1220,12 @@ value obj_get_property(script_machine * machine, int argc, value const * argv)
 	assert(argc == 2);
 
 	if (argv[0].get_type()->get_kind() != type_data::tk_object)
+	{
 		machine->raise_error("Cannot access property from non-object value.");
+		return value();
+	}
 
-	value result = argv[0].get_property(argv[1].as_string());
+	value result = argv[0].get_property(machine->get_engine()->get_atoms().find(argv[1].as_string()));
 
 	if (!result.has_data())
 		machine->raise_error("Property not found.");
@@ -1106,9 +1240,15 @@ value obj_set_property(script_machine * machine, int argc, value const * argv)
 	value o = argv[0];
 
 	if (o.get_type()->get_kind() != type_data::tk_object)
+	{
 		machine->raise_error("Cannot set property for non-object value.");
+		return value();
+	}
 
-	if (!o.set_property(argv[2].as_string(), argv[1]))
+	int atom = machine->get_engine()->get_atoms().find(argv[2].as_string());
+	if (!o.get_property(atom).has_data())
+		machine->raise_error("Property not found.");
+	else if (!o.set_property(atom, argv[1]))
 		machine->raise_error("Type mismatch on property assignment.");
 
 	return value();
@@ -1144,12 +1284,47 @@ function const operations[] =
 	{ "concatenate", concatenate, 2 },
 	{ "compare", compare, 2 },
 	{ "assert", assert_, 2 },
+	{ "sleep", sleep_, 1 },
 	{ "obj_register_property", obj_register_property, 3 },
 	{ "obj_get_property", obj_get_property, 2 },
 	{ "obj_set_property", obj_set_property, 3 }
 };
 
 
+// Operators compiled into dedicated codes while the built-in function is not overridden
+struct operation_code
+{
+	callback func;
+	script_engine::command_kind command;
+};
+
+operation_code const operation_codes[] =
+{
+	{ add, script_engine::pc_add },
+	{ subtract, script_engine::pc_subtract },
+	{ multiply, script_engine::pc_multiply },
+	{ divide, script_engine::pc_divide },
+	{ remainder, script_engine::pc_remainder },
+	{ power, script_engine::pc_power },
+	{ compare, script_engine::pc_compare },
+	{ negative, script_engine::pc_negative },
+	{ successor, script_engine::pc_successor },
+	{ predecessor, script_engine::pc_predecessor },
+	{ concatenate, script_engine::pc_concatenate }
+};
+
+// Native function behind an operation code
+static callback operation_function(script_engine::command_kind command)
+{
+	for (unsigned i = 0; i < sizeof(operation_codes) / sizeof(operation_code); ++i)
+	{
+		if (operation_codes[i].command == command)
+			return operation_codes[i].func;
+	}
+	return NULL;
+}
+
+
 /* parser */
 
 class parser
@@ -1162,11 +1337,41 @@ public:
 		int variable;
 	};
 
-	struct scope : public std::map < std::string, symbol >
+	struct scope : public std::unordered_map < unsigned, symbol >	//symbols by the atoms of their names
 	{
 		script_engine::block_kind kind;
+		bool inlined;	//the statements go into the block of the enclosing scope
+
+		scope(script_engine::block_kind the_kind) : kind(the_kind), inlined(false)
+		{
+		}
+	};
+
+	// A declaration found by hoist
+	struct declaration
+	{
+		token_kind keyword;	//tk_LET for variables, tk_THIS, or the keyword defining a routine
+		std::string name;
+		unsigned atom;
+		int line;	//line of the name, for errors
+		int arguments;	//routines: the number of arguments, this included
+	};
 
-		scope(script_engine::block_kind the_kind) : kind(the_kind)
+	// What one pair of braces declares directly inside, in source order
+	struct hoisted_scope
+	{
+		std::vector < declaration > declarations;
+		std::vector < unsigned > words;	//atoms of the identifiers used directly inside
+		int parent;
+		int owner;	//the body of the function or task the scope belongs to, -1 outside them
+		int routine;	//bodies of functions and tasks: their declaration in the parent
+		bool has_this;
+		bool defines_routine;	//the flags below also cover nested braces
+		bool breaks;
+		bool calls_task;
+
+		hoisted_scope(int the_parent, int the_owner) : declarations(), words(), parent(the_parent), owner(the_owner), routine(-1),
+			has_this(false), defines_routine(false), breaks(false), calls_task(false)
 		{
 		}
 	};
@@ -1177,7 +1382,9 @@ public:
 	bool error;
 	std::string error_message;
 	int error_line;
-	std::map < std::string, script_engine::block * > events;
+	std::map < unsigned, script_engine::block * > events;
+	std::vector < hoisted_scope > hoisted;
+	std::map < char const *, unsigned > hoisted_at;	//scopes by where their first token ends
 
 	parser(script_engine * e, scanner * s, int funcc, function const * funcv);
 
@@ -1197,22 +1404,43 @@ public:
 	int parse_arguments(script_engine::block * block);
 	void parse_statements(script_engine::block * block);
 	void parse_inline_block(script_engine::block * block, script_engine::block_kind kind);
+	void parse_loop_body(script_engine::block * block, std::vector < std::string > const * args);
+	void parse_inlined_body(script_engine::block * block, script_engine::block_kind kind, std::vector < std::string > const * args);
 	void parse_block(script_engine::block * block, std::vector < std::string > const * args, bool adding_result, bool finding_this);
 private:
 	void register_function(function const & func);
+	symbol * search(unsigned atom);
 	symbol * search(std::string const & name);
 	symbol * search_result();
-	void scan_current_scope(int level, std::vector < std::string > const * args, bool adding_result, bool finding_this);
+	void hoist();
+	void scan_current_scope(int level, std::vector < std::string > const * args, bool adding_result, bool finding_this,
+		int first_variable = 0);
+	void count_variables(script_engine::block * block);
+	bool can_inline(bool looping);
 	void write_operation(script_engine::block * block, char const * name, int clauses);
+	bool search_operation(char const * name, script_engine::command_kind & command);
+	bool search_properties();
+	void write_property(script_engine::block * block, std::string const & name, bool writing);
+	void write_modify(script_engine::block * block, script_engine::command_kind command, script_engine::command_kind operation,
+		std::string const & name);
+	void resolve_jumps(script_engine::block * block);
 
 	typedef script_engine::code code;
+
+	code literal(value const & v)
+	{
+		// A push_value code whose value goes to the constant pool
+		code c(script_engine::pc_push_value);
+		c.constant = engine->add_constant(v);
+		return c;
+	}
 };
 
 parser::parser(script_engine * e, scanner * s, int funcc, function const * funcv) : engine(e), lex(s), frame(), error(false)
 {
 	frame.push_back(scope(script_engine::bk_normal));
 
-	for (int i = 0; i < sizeof(operations) / sizeof(function); ++i)
+	for (unsigned i = 0; i < sizeof(operations) / sizeof(function); ++i)
 		register_function(operations[i]);
 
 	for (int i = 0; i < funcc; ++i)
@@ -1220,8 +1448,11 @@ parser::parser(script_engine * e, scanner * s, int funcc, function const * funcv
 
 	try
 	{
+		hoist();
 		scan_current_scope(0, NULL, false, false);
+		count_variables(engine->main_block);
 		parse_statements(engine->main_block);
+		resolve_jumps(engine->main_block);
 		if (lex->next != tk_end)
 			throw parser_error("cannot be interpreted. (did you forget \";\"?"); //߂łȂ̂܂(u;vYĂ܂)
 	}
@@ -1242,210 +1473,158 @@ void parser::register_function(function const & func)
 	s.sub->name = func.name;
 	s.sub->func = func.func;
 	s.variable = -1;
-	frame[0][func.name] = s;
+	frame[0][engine->get_atoms().intern(std::string(func.name))] = s;
 }
 
-parser::symbol * parser::search(std::string const & name)
+parser::symbol * parser::search(unsigned atom)
 {
 	for (int i = frame.size() - 1; i >= 0; --i)
 	{
-		if (frame[i].find(name) != frame[i].end())
-			return &(frame[i][name]);
+		scope::iterator found = frame[i].find(atom);
+		if (found != frame[i].end())
+			return &found->second;
 	}
 	return NULL;
 }
 
+parser::symbol * parser::search(std::string const & name)
+{
+	return search(engine->get_atoms().intern(name));
+}
+
 parser::symbol * parser::search_result()
 {
+	unsigned result = engine->get_atoms().intern(std::string("result"));
 	for (int i = frame.size() - 1; i >= 0; --i)
 	{
-		if (frame[i].find("result") != frame[i].end())
-			return &(frame[i]["result"]);
+		scope::iterator found = frame[i].find(result);
+		if (found != frame[i].end())
+			return &found->second;
 		if (frame[i].kind == script_engine::bk_sub || frame[i].kind == script_engine::bk_microthread)
 			return NULL;
 	}
 	return NULL;
 }
 
-void parser::scan_current_scope(int level, std::vector < std::string > const * args, bool adding_result, bool finding_this)
+void parser::hoist()
 {
-	//look ahead to register an identifier //ǂ݂Ďʎqo^
+	// One pass over the whole source gathers the declarations of every scope before parsing starts
+	// A function or task takes this as an extra argument when it uses this outside the functions and tasks defined in it
 	scanner lex2(*lex);
 	try
 	{
-		scope * current_frame = &frame[frame.size() - 1];
+		std::set < unsigned > tasks;
+		hoisted.push_back(hoisted_scope(-1, -1));
+		hoisted_at[lex2.current] = 0;
 		int cur = 0;
-		int var = 0;
-		bool registered_this = false;
-
-		if (adding_result)
-		{
-			symbol s;
-			s.level = level;
-			s.sub = NULL;
-			s.variable = var;
-			++var;
-			(*current_frame)["result"] = s;
-		}
-
-		if (args != NULL)
-		{
-			for (unsigned i = 0; i < args->size(); ++i)
-			{
-				symbol s;
-				s.level = level;
-				s.sub = NULL;
-				s.variable = var;
-				++var;
-				(*current_frame)[(*args)[i]] = s;
-			}
-		}
-
+		int body = -1;	//a function or task declared just before, its body opens with the next brace
 		while (cur >= 0 && lex2.next != tk_end && lex2.next != tk_invalid)
 		{
+			int routine = body;
+			body = -1;
 			switch (lex2.next)
 			{
 			case tk_open_cur:
-				++cur;
+			{
 				lex2.advance();
-				break;
+				int owner = (routine >= 0) ? static_cast < int > (hoisted.size()) : hoisted[cur].owner;
+				hoisted.push_back(hoisted_scope(cur, owner));
+				hoisted.back().routine = routine;
+				cur = hoisted.size() - 1;
+				hoisted_at[lex2.current] = cur;
+			}
+			continue;
 			case tk_close_cur:
-				--cur;
-				lex2.advance();
+				cur = hoisted[cur].parent;
 				break;
 			case tk_at:
 			case tk_SUB:
 			case tk_FUNCTION:
 			case tk_TASK:
 			{
-				token_kind type = lex2.next;
+				declaration d;
+				d.keyword = lex2.next;
+				d.arguments = 0;
 				lex2.advance();
-				if (cur == 0)
+				d.name = lex2.word;
+				d.atom = engine->get_atoms().intern(d.name);
+				d.line = lex2.line;
+				lex2.advance();
+				if (lex2.next == tk_open_par)
 				{
-					if ((*current_frame).find(lex2.word) != (*current_frame).end())
-						throw parser_error("A routine is defined twice"); //XR[vœ̃[`錾Ă܂
-					script_engine::block_kind kind = (type == tk_SUB || type == tk_at) ? script_engine::bk_sub :
-						(type == tk_FUNCTION) ? script_engine::bk_function : script_engine::bk_microthread;
-
-					symbol s;
-					s.level = level;
-					s.sub = engine->new_block(level + 1, kind);
-					s.sub->name = lex2.word;
-					s.sub->func = NULL;
-					s.variable = -1;
-					(*current_frame)[lex2.word] = s;
 					lex2.advance();
-					if (kind != script_engine::bk_sub && lex2.next == tk_open_par)
+					while (d.keyword != tk_at && d.keyword != tk_SUB
+						&& (lex2.next == tk_word || lex2.next == tk_LET || lex2.next == tk_REAL))
 					{
+						++d.arguments;
+						if (lex2.next == tk_LET || lex2.next == tk_REAL) lex2.advance();
+						if (lex2.next == tk_word) lex2.advance();
+						if (lex2.next != tk_comma)
+							break;
 						lex2.advance();
-						while (lex2.next == tk_word || lex2.next == tk_LET || lex2.next == tk_REAL)
-						{
-							++(s.sub->arguments);
-							if (lex2.next == tk_LET || lex2.next == tk_REAL) lex2.advance();
-							if (lex2.next == tk_word) lex2.advance();
-							if (lex2.next != tk_comma)
-								break;
-							lex2.advance();
-						}
 					}
-
-					// Extra scan ahead for "this" keyword to use as an extra argument.
-					if (kind == script_engine::bk_function || kind == script_engine::bk_microthread)
-					{
-						if (lex2.next == tk_close_par)
-							lex2.advance();
+					if (lex2.next == tk_close_par)
 						lex2.advance();
-						cur++;
-						lex2.advance();
-						bool found_this = false;
-						int func;
-						while (cur >= 1 && lex2.next != tk_end && lex2.next != tk_invalid)
-						{
-							switch (lex2.next)
-							{
-							case tk_open_cur:
-								++cur;
-								lex2.advance();
-								break;
-							case tk_close_cur:
-								--cur;
-								lex2.advance();
-								break;
-							case tk_FUNCTION:
-							case tk_TASK:
-								func = cur;
-								while (cur >= func && lex2.next != tk_end && lex2.next != tk_invalid)
-								{
-									switch (lex2.next)
-									{
-									case tk_open_cur:
-										++cur;
-										lex2.advance();
-										break;
-									case tk_close_cur:
-										--cur;
-										lex2.advance();
-										break;
-									default:
-										lex2.advance();
-									}
-								}
-								break;
-							case tk_THIS:
-								if (!found_this) {
-									++(s.sub->arguments);
-									found_this = true;
-								}
-								lex2.advance();
-								break;
-							default:
-								lex2.advance();
-							}
-						}
-					}
 				}
+				if (d.keyword == tk_FUNCTION || d.keyword == tk_TASK)
+					body = hoisted[cur].declarations.size();
+				if (d.keyword == tk_TASK)
+					tasks.insert(d.atom);
+				hoisted[cur].declarations.push_back(d);
+				hoisted[cur].defines_routine = true;
 			}
-			break;
-			case tk_THIS:
-				if (finding_this && !registered_this)
-				{
-					symbol s;
-					s.level = level;
-					s.sub = NULL;
-					s.variable = var;
-					++var;
-					(*current_frame)["this"] = s;
-					registered_this = true;
-				}
-				lex2.advance();
-			break;
+			continue;
 			case tk_REAL:
 			case tk_LET:
+			{
 				lex2.advance();
-				if (cur == 0)
+				declaration d;
+				d.keyword = tk_LET;
+				d.name = lex2.word;
+				d.atom = engine->get_atoms().intern(d.name);
+				d.line = lex2.line;
+				d.arguments = 0;
+				hoisted[cur].declarations.push_back(d);
+			}
+			break;
+			case tk_THIS:
+			{
+				int owner = hoisted[cur].owner;
+				if (owner >= 0 && !hoisted[owner].has_this)
 				{
-#ifdef __SCRIPT_H__NO_CHECK_DUPLICATED
-					if (lex2.word == "result") {
-#endif
-						if ((*current_frame).find(lex2.word) != (*current_frame).end())
-						{
-							throw parser_error("Variables with the same name are declared in the same scope"); //XR[vœ̕ϐ錾Ă܂
-						}
-#ifdef __SCRIPT_H__NO_CHECK_DUPLICATED
-					}
-#endif
-					symbol s;
-					s.level = level;
-					s.sub = NULL;
-					s.variable = var;
-					++var;
-					(*current_frame)[lex2.word] = s;
-					lex2.advance();
+					hoisted_scope & o = hoisted[owner];
+					o.has_this = true;
+					declaration d;
+					d.keyword = tk_THIS;
+					d.name = "this";
+					d.atom = engine->get_atoms().intern(d.name);
+					d.line = lex2.line;
+					d.arguments = 0;
+					o.declarations.push_back(d);
+					++hoisted[o.parent].declarations[o.routine].arguments;
 				}
+			}
+			break;
+			case tk_BREAK:
+				hoisted[cur].breaks = true;
+				break;
+			case tk_word:
+				hoisted[cur].words.push_back(engine->get_atoms().intern(lex2.word));
 				break;
-			default:
-				lex2.advance();
 			}
+			lex2.advance();
+		}
+
+		// Scopes come after the scope around them, so one backward sweep carries the flags outwards
+		for (unsigned i = hoisted.size(); i-- > 1; )
+		{
+			hoisted_scope & h = hoisted[i];
+			for (unsigned j = 0; j < h.words.size() && !h.calls_task; ++j)
+				h.calls_task = tasks.find(h.words[j]) != tasks.end();
+			hoisted_scope & p = hoisted[h.parent];
+			p.defines_routine = p.defines_routine || h.defines_routine;
+			p.breaks = p.breaks || h.breaks;
+			p.calls_task = p.calls_task || h.calls_task;
 		}
 	}
 	catch (parser_error e)
@@ -1455,6 +1634,115 @@ void parser::scan_current_scope(int level, std::vector < std::string > const * a
 	}
 }
 
+void parser::scan_current_scope(int level, std::vector < std::string > const * args, bool adding_result, bool finding_this,
+	int first_variable)
+{
+	//look ahead to register an identifier //ǂ݂Ďʎqo^
+	scope * current_frame = &frame[frame.size() - 1];
+	int var = first_variable;
+
+	if (adding_result)
+	{
+		symbol s;
+		s.level = level;
+		s.sub = NULL;
+		s.variable = var;
+		++var;
+		(*current_frame)[engine->get_atoms().intern(std::string("result"))] = s;
+	}
+
+	if (args != NULL)
+	{
+		for (unsigned i = 0; i < args->size(); ++i)
+		{
+			symbol s;
+			s.level = level;
+			s.sub = NULL;
+			s.variable = var;
+			++var;
+			(*current_frame)[engine->get_atoms().intern((*args)[i])] = s;
+		}
+	}
+
+	// The scope starts right after lex->current
+	std::map < char const *, unsigned >::iterator found = hoisted_at.find(lex->current);
+	if (found == hoisted_at.end())
+		return;
+	std::vector < declaration > const & declarations = hoisted[found->second].declarations;
+	for (unsigned i = 0; i < declarations.size(); ++i)
+	{
+		declaration const & d = declarations[i];
+		symbol s;
+		s.level = level;
+		s.sub = NULL;
+		s.variable = -1;
+		switch (d.keyword)
+		{
+		case tk_LET:
+#ifdef __SCRIPT_H__NO_CHECK_DUPLICATED
+			if (d.name == "result") {
+#endif
+				if ((*current_frame).find(d.atom) != (*current_frame).end())
+				{
+					lex->line = d.line;
+					throw parser_error("Variables with the same name are declared in the same scope"); //XR[vœ̕ϐ錾Ă܂
+				}
+#ifdef __SCRIPT_H__NO_CHECK_DUPLICATED
+			}
+#endif
+			s.variable = var;
+			++var;
+			break;
+		case tk_THIS:
+			if (!finding_this)
+				continue;
+			s.variable = var;
+			++var;
+			break;
+		default:
+			if ((*current_frame).find(d.atom) != (*current_frame).end())
+			{
+				lex->line = d.line;
+				throw parser_error("A routine is defined twice"); //XR[vœ̃[`錾Ă܂
+			}
+			s.sub = engine->new_block(level + 1, (d.keyword == tk_SUB || d.keyword == tk_at) ? script_engine::bk_sub :
+				(d.keyword == tk_FUNCTION) ? script_engine::bk_function : script_engine::bk_microthread);
+			s.sub->name = d.name;
+			s.sub->func = NULL;
+			s.sub->arguments = d.arguments;
+			break;
+		}
+		(*current_frame)[d.atom] = s;
+	}
+}
+
+void parser::count_variables(script_engine::block * block)
+{
+	// The variables of the innermost scope, so environments of the block can reserve them
+	for (scope::iterator i = frame.back().begin(); i != frame.back().end(); ++i)
+	{
+		if (i->second.sub == NULL && i->second.variable >= block->variables)
+			block->variables = i->second.variable + 1;
+	}
+}
+
+bool parser::can_inline(bool looping)
+{
+	// A body can run in the environment of the block around it unless that environment could escape:
+	// routines defined inside would capture its variables and tasks started inside would outlive it
+	// break in a loop body looks for the environment of the loop
+	// Words naming a task anywhere in the source count as starting it, whatever they resolve to here
+	if (lex->next != tk_open_cur)
+		return false;
+	scanner lex2(*lex);
+	lex2.advance();
+	std::map < char const *, unsigned >::iterator found = hoisted_at.find(lex2.current);
+	if (found == hoisted_at.end())
+		return false;
+	hoisted_scope const & h = hoisted[found->second];
+	return !h.defines_routine && !h.calls_task && !(looping && h.breaks);
+}
+
 void parser::write_operation(script_engine::block * block, char const * name, int clauses)
 {
 	symbol * s = search(name);
@@ -1462,44 +1750,203 @@ void parser::write_operation(script_engine::block * block, char const * name, in
 	if (s->sub->arguments != clauses)
 		throw parser_error("A function called by an operator was overwritten using a different number of arguments.");
 
-	block->codes.push_back(script_engine::code(lex->line, script_engine::pc_call_and_push_result, s->sub, clauses));
+	// Use a dedicated code when the symbol still refers to the built-in function
+	for (unsigned i = 0; i < sizeof(operation_codes) / sizeof(operation_code); ++i)
+	{
+		if (s->sub->func == operation_codes[i].func)
+		{
+			block->push_code(lex->line, script_engine::code(operation_codes[i].command, s->sub, clauses));
+			return;
+		}
+	}
+
+	block->push_code(lex->line, script_engine::code(script_engine::pc_call_and_push_result, s->sub, clauses));
 }
 
-void parser::parse_parentheses(script_engine::block * block)
+bool parser::search_operation(char const * name, script_engine::command_kind & command)
 {
-	if (lex->next != tk_open_par)
-		throw parser_error("Expected token: \"(\"");
-	lex->advance();
-
-	parse_expression(block);
+	// Finds the code of an operator while the symbol still refers to the built-in function
+	symbol * s = search(name);
+	assert(s != NULL);
+	for (unsigned i = 0; i < sizeof(operation_codes) / sizeof(operation_code); ++i)
+	{
+		if (s->sub->func == operation_codes[i].func)
+		{
+			command = operation_codes[i].command;
+			return true;
+		}
+	}
+	return false;
+}
 
-	if (lex->next != tk_close_par)
-		throw parser_error("Expected token: \")\"");
-	lex->advance();
+bool parser::search_properties()
+{
+	// Checks that both property functions still refer to the built-in ones
+	return search("obj_get_property")->sub->func == obj_get_property
+		&& search("obj_set_property")->sub->func == obj_set_property;
 }
 
-void parser::parse_clause(script_engine::block * block)
+void parser::write_property(script_engine::block * block, std::string const & name, bool writing)
 {
-	if (lex->next == tk_real)
+	// Expects the object on the stack, and the new value above it when writing
+	// Use a code with an inline cache while the symbol still refers to the built-in function
+	char const * function = writing ? "obj_set_property" : "obj_get_property";
+	symbol * s = search(function);
+	assert(s != NULL);
+	if (s->sub->func == (writing ? obj_set_property : obj_get_property))
 	{
-		block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_real_type(), lex->real_value)));
-		lex->advance();
+		script_engine::code c(writing ? script_engine::pc_set_property : script_engine::pc_get_property);
+		c.atom = engine->get_atoms().intern(name);
+		c.cached_shape = NULL;
+		c.cached_slot = 0;
+		block->push_code(lex->line, c);
+		return;
 	}
-	else if (lex->next == tk_char)
+
+	block->push_code(lex->line, literal(value(engine->get_string_type(), to_wide(name))));
+	write_operation(block, function, writing ? 3 : 2);
+	if (writing)
+		block->push_code(lex->line, script_engine::code(script_engine::pc_pop));
+}
+
+void parser::write_modify(script_engine::block * block, script_engine::command_kind command, script_engine::command_kind operation,
+	std::string const & name)
+{
+	// Expects the array and the index, or the object, on the stack, and for binary operators the old value and the operand above them
+	script_engine::code c(command);
+	if (command == script_engine::pc_modify_property)
+		c.atom = engine->get_atoms().intern(name);
+	c.cached_shape = NULL;
+	c.cached_slot = 0;
+	c.operation = operation;
+	block->push_code(lex->line, c);
+}
+
+void parser::resolve_jumps(script_engine::block * block)
+{
+	// Store jump destinations in the codes so branches never scan at runtime
+	// case_if and case_if_not jump past the next case_next, or to the matching case_end
+	// case_next jumps to the matching case_end
+	// Loop exits jump past the loop_back or range back code that closes their loop, bodies inlined into the block nest loops
+	struct case_frame
 	{
-		block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_char_type(), lex->char_value)));
-		lex->advance();
-	}
-	else if (lex->next == tk_string)
+		std::vector < int > ifs;
+		std::vector < int > nexts;
+	};
+
+	std::vector < case_frame > cases;
+	std::vector < int > loop_exits;
+	std::vector < std::pair < int, script_engine::block * > > loop_blocks;
+
+	for (unsigned i = 0; i < block->codes.length; ++i)
 	{
-		std::wstring str = lex->string_value;
-		lex->advance();
-		while (lex->next == tk_string || lex->next == tk_char)
+		code & c = block->codes.at[i];
+		switch (c.command)
 		{
-			str += (lex->next == tk_string) ? lex->string_value : (std::wstring() + lex->char_value);
-			lex->advance();
-		}
-		block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), str)));
+		case script_engine::pc_case_begin:
+			cases.push_back(case_frame());
+			break;
+
+		case script_engine::pc_case_if:
+		case script_engine::pc_case_if_not:
+			assert(!cases.empty());
+			cases.back().ifs.push_back(i);
+			break;
+
+		case script_engine::pc_case_next:
+		{
+			assert(!cases.empty());
+			case_frame & f = cases.back();
+			for (unsigned j = 0; j < f.ifs.size(); ++j)
+				block->codes.at[f.ifs[j]].ip = i + 1;
+			f.ifs.clear();
+			f.nexts.push_back(i);
+		}
+		break;
+
+		case script_engine::pc_case_end:
+		{
+			assert(!cases.empty());
+			case_frame & f = cases.back();
+			for (unsigned j = 0; j < f.ifs.size(); ++j)
+				block->codes.at[f.ifs[j]].ip = i;
+			for (unsigned j = 0; j < f.nexts.size(); ++j)
+				block->codes.at[f.nexts[j]].ip = i;
+			cases.pop_back();
+		}
+		break;
+
+		case script_engine::pc_loop_count:
+		case script_engine::pc_loop_if:
+		case script_engine::pc_loop_ascent:
+		case script_engine::pc_loop_descent:
+		case script_engine::pc_range_ascent:
+		case script_engine::pc_range_descent:
+			loop_exits.push_back(i);
+			break;
+
+		case script_engine::pc_call:
+			if (c.sub->kind == script_engine::bk_loop)
+				loop_blocks.push_back(std::make_pair(i, c.sub));
+			break;
+
+		case script_engine::pc_loop_back:
+		case script_engine::pc_loop_count_back:
+		case script_engine::pc_range_ascent_back:
+		case script_engine::pc_range_descent_back:
+			// The loop starts at the code it jumps back to, exits and bodies from there on are its own
+			while (!loop_exits.empty() && loop_exits.back() >= c.ip)
+			{
+				block->codes.at[loop_exits.back()].ip = i + 1;
+				loop_exits.pop_back();
+			}
+			while (!loop_blocks.empty() && loop_blocks.back().first >= c.ip)
+			{
+				loop_blocks.back().second->break_ip = i + 1;
+				loop_blocks.pop_back();
+			}
+			break;
+		}
+	}
+
+	assert(cases.empty() && loop_exits.empty() && loop_blocks.empty());
+}
+
+void parser::parse_parentheses(script_engine::block * block)
+{
+	if (lex->next != tk_open_par)
+		throw parser_error("Expected token: \"(\"");
+	lex->advance();
+
+	parse_expression(block);
+
+	if (lex->next != tk_close_par)
+		throw parser_error("Expected token: \")\"");
+	lex->advance();
+}
+
+void parser::parse_clause(script_engine::block * block)
+{
+	if (lex->next == tk_real)
+	{
+		block->push_code(lex->line, literal(value::make_number(engine->get_real_type(), lex->real_value)));
+		lex->advance();
+	}
+	else if (lex->next == tk_char)
+	{
+		block->push_code(lex->line, literal(value(engine->get_char_type(), lex->char_value)));
+		lex->advance();
+	}
+	else if (lex->next == tk_string)
+	{
+		std::wstring str = lex->string_value;
+		lex->advance();
+		while (lex->next == tk_string || lex->next == tk_char)
+		{
+			str += (lex->next == tk_string) ? lex->string_value : (std::wstring() + lex->char_value);
+			lex->advance();
+		}
+		block->push_code(lex->line, literal(value(engine->get_string_type(), str)));
 	}
 	else if (lex->next == tk_word || lex->next == tk_THIS)
 	{
@@ -1519,19 +1966,19 @@ void parser::parse_clause(script_engine::block * block)
 			if (argc != s->sub->arguments)
 				throw parser_error("Incorrect number of arguments for: " + s->sub->name);
 
-			block->codes.push_back(code(lex->line, script_engine::pc_call_and_push_result, s->sub, argc));
+			block->push_code(lex->line, code(script_engine::pc_call_and_push_result, s->sub, argc));
 		}
 		else
 		{
 			//ϐ
-			block->codes.push_back(code(lex->line, script_engine::pc_push_variable, s->level, s->variable));
+			block->push_code(lex->line, code(script_engine::pc_push_variable, s->level, s->variable));
 
 		}
 	}
 	else if (lex->next == tk_open_bra)
 	{
 		lex->advance();
-		block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), std::wstring())));
+		block->push_code(lex->line, literal(value(engine->get_string_type(), std::wstring())));
 		while (lex->next != tk_close_bra)
 		{
 			parse_expression(block);
@@ -1558,7 +2005,7 @@ void parser::parse_clause(script_engine::block * block)
 	}
 	else if (lex->next == tk_open_cur)
 	{
-		block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_object_type())));
+		block->push_code(lex->line, literal(value(engine->get_object_type())));
 
 		lex->advance();
 
@@ -1566,8 +2013,8 @@ void parser::parse_clause(script_engine::block * block)
 
 			if (lex->next != tk_word)
 				throw parser_error("Expected property identifier.");
-			block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(lex->word))));
-			block->codes.push_back(code(lex->line, script_engine::pc_swap));
+			block->push_code(lex->line, literal(value(engine->get_string_type(), to_wide(lex->word))));
+			block->push_code(lex->line, code(script_engine::pc_swap));
 			lex->advance();
 
 			if (lex->next != tk_colon)
@@ -1575,7 +2022,7 @@ void parser::parse_clause(script_engine::block * block)
 			lex->advance();
 
 			parse_expression(block);
-			block->codes.push_back(code(lex->line, script_engine::pc_swap));
+			block->push_code(lex->line, code(script_engine::pc_swap));
 
 			write_operation(block, "obj_register_property", 3);
 
@@ -1637,13 +2084,12 @@ void parser::parse_suffix(script_engine::block * block)
 						if (argc != s->sub->arguments)
 							throw parser_error("Incorrect number of arguments for: " + s->sub->name);
 
-						block->codes.push_back(code(lex->line, script_engine::pc_call_and_push_result, s->sub, argc));
+						block->push_code(lex->line, code(script_engine::pc_call_and_push_result, s->sub, argc));
 					}
 				}
 				else 
 				{
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(lex->word))));
-					write_operation(block, "obj_get_property", 2);
+					write_property(block, lex->word, false);
 				}
 			}
 
@@ -1742,22 +2188,22 @@ void parser::parse_comparison(script_engine::block * block)
 		switch (op)
 		{
 		case tk_e:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_e));
+			block->push_code(lex->line, code(script_engine::pc_compare_e));
 			break;
 		case tk_g:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_g));
+			block->push_code(lex->line, code(script_engine::pc_compare_g));
 			break;
 		case tk_ge:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_ge));
+			block->push_code(lex->line, code(script_engine::pc_compare_ge));
 			break;
 		case tk_l:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_l));
+			block->push_code(lex->line, code(script_engine::pc_compare_l));
 			break;
 		case tk_le:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_le));
+			block->push_code(lex->line, code(script_engine::pc_compare_le));
 			break;
 		case tk_ne:
-			block->codes.push_back(code(lex->line, script_engine::pc_compare_ne));
+			block->push_code(lex->line, code(script_engine::pc_compare_ne));
 			break;
 		}
 		break;
@@ -1772,14 +2218,14 @@ void parser::parse_logic(script_engine::block * block)
 		script_engine::command_kind cmd = (lex->next == tk_and_then) ? script_engine::pc_case_if_not : script_engine::pc_case_if;
 		lex->advance();
 
-		block->codes.push_back(code(lex->line, script_engine::pc_dup));
-		block->codes.push_back(code(lex->line, script_engine::pc_case_begin));
-		block->codes.push_back(code(lex->line, cmd));
-		block->codes.push_back(code(lex->line, script_engine::pc_pop));
+		block->push_code(lex->line, code(script_engine::pc_dup));
+		block->push_code(lex->line, code(script_engine::pc_case_begin));
+		block->push_code(lex->line, code(cmd));
+		block->push_code(lex->line, code(script_engine::pc_pop));
 
 		parse_comparison(block);
 
-		block->codes.push_back(code(lex->line, script_engine::pc_case_end));
+		block->push_code(lex->line, code(script_engine::pc_case_end));
 	}
 }
 
@@ -1829,10 +2275,10 @@ void parser::parse_statements(script_engine::block * block)
 			bool as_array = false;
 
 			if (lex->next == tk_property) {
-				block->codes.push_back(code(lex->line, script_engine::pc_push_variable, s->level, s->variable));
+				block->push_code(lex->line, code(script_engine::pc_push_variable, s->level, s->variable));
 			}
 			else if(lex->next == tk_open_bra) {
-				block->codes.push_back(code(lex->line, script_engine::pc_push_variable_writable, s->level, s->variable));
+				block->push_code(lex->line, code(script_engine::pc_push_variable_writable, s->level, s->variable));
 			}
 			else if (with_this) {
 				throw parser_error("Direct assignment to \"this\" is not allowed.");
@@ -1849,18 +2295,18 @@ void parser::parse_statements(script_engine::block * block)
 						throw parser_error("Expected token: \"]\"");
 					lex->advance();
 
-					if (lex->next != tk_open_bra && lex->next != tk_property)
-					{
+					// If it's not a property or array index, it must be an array overwrite.
+					// The array and the index are left on the stack for pc_assign_writable.
+					// Nested arrays are made unique before writing into them.
+					if (lex->next == tk_open_bra) {
 						write_operation(block, "index!", 2);
-						as_array = true;
 					}
-					else {
+					else if (lex->next == tk_property) {
 						write_operation(block, "index", 2);
 					}
-					// Check next
-					// If it's not a property or array index, it must be an array overwrite.
-					// Otherwise we need to evaluate it first then try again.
-					// We'll need a function to prepare a pushed value this way to be indexed as an array.
+					else {
+						as_array = true;
+					}
 				}
 
 				while (lex->next == tk_property)
@@ -1869,8 +2315,7 @@ void parser::parse_statements(script_engine::block * block)
 					lex->advance();
 					if (lex->next == tk_property || lex->next == tk_open_bra)
 					{
-						block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-						write_operation(block, "obj_get_property", 2);
+						write_property(block, prop, false);
 						prop = "";
 					}
 					// If the trailing end is a property, there are two possibilities.
@@ -1889,15 +2334,13 @@ void parser::parse_statements(script_engine::block * block)
 				lex->advance();
 				parse_expression(block);
 				if (as_obj) {
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-					write_operation(block, "obj_set_property", 3);
-					block->codes.push_back(code(lex->line, script_engine::pc_pop));
+					write_property(block, prop, true);
 				}
 				else if (as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign_writable));
+					block->push_code(lex->line, code(script_engine::pc_assign_writable));
 				}
 				else {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+					block->push_code(lex->line, code(script_engine::pc_assign, s->level, s->variable));
 				}
 				break;
 
@@ -1939,31 +2382,60 @@ void parser::parse_statements(script_engine::block * block)
 				}
 				lex->advance();
 
+				script_engine::command_kind operation;
+				if (search_operation(f, operation))
+				{
+					// Elements and properties are changed in place with the built-in operators
+					// The old value is read before the right side runs, as it is for variables
+					if (as_array || (as_obj && search_properties()))
+					{
+						if (as_obj)
+						{
+							block->push_code(lex->line, code(script_engine::pc_dup));
+							write_property(block, prop, false);
+						}
+						else
+						{
+							block->push_code(lex->line, code(script_engine::pc_dup2));
+							write_operation(block, "index", 2);
+						}
+						parse_expression(block);
+						write_modify(block, as_obj ? script_engine::pc_modify_property : script_engine::pc_modify_element,
+							operation, prop);
+						break;
+					}
+					// A variable appended to with the built-in concatenation grows in place
+					if (operation == script_engine::pc_concatenate && !as_obj && !as_array)
+					{
+						parse_expression(block);
+						block->push_code(lex->line, code(script_engine::pc_concatenate_assign, s->level, s->variable));
+						break;
+					}
+				}
+
 				if (as_obj) {
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-					write_operation(block, "obj_get_property", 2);
+					block->push_code(lex->line, code(script_engine::pc_dup));
+					write_property(block, prop, false);
 				}
 				else if (as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
+					block->push_code(lex->line, code(script_engine::pc_dup2));
+					write_operation(block, "index!", 2);
 				}
 				else {
-					block->codes.push_back(code(lex->line, script_engine::pc_push_variable, s->level, s->variable));
+					block->push_code(lex->line, code(script_engine::pc_push_variable, s->level, s->variable));
 				}
 
 				parse_expression(block);
 				write_operation(block, f, 2);
 
 				if (as_obj) {
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-					write_operation(block, "obj_set_property", 3);
-					block->codes.push_back(code(lex->line, script_engine::pc_pop));
+					write_property(block, prop, true);
 				}
 				else if (as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign_writable));
+					block->push_code(lex->line, code(script_engine::pc_assign_writable));
 				}
 				else {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+					block->push_code(lex->line, code(script_engine::pc_assign, s->level, s->variable));
 				}
 
 			}
@@ -1975,30 +2447,36 @@ void parser::parse_statements(script_engine::block * block)
 				char const * f = (lex->next == tk_inc) ? "successor" : "predecessor";
 				lex->advance();
 
+				script_engine::command_kind operation;
+				if ((as_array || (as_obj && search_properties())) && search_operation(f, operation))
+				{
+					write_modify(block, as_obj ? script_engine::pc_modify_property : script_engine::pc_modify_element,
+						operation, prop);
+					break;
+				}
+
 				if (!as_obj && !as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_push_variable, s->level, s->variable));
+					block->push_code(lex->line, code(script_engine::pc_push_variable, s->level, s->variable));
 				}
 				else if (as_obj) {
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-					write_operation(block, "obj_get_property", 2);
+					block->push_code(lex->line, code(script_engine::pc_dup));
+					write_property(block, prop, false);
 				}
 				else if (as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
+					block->push_code(lex->line, code(script_engine::pc_dup2));
+					write_operation(block, "index!", 2);
 				}
 
 				write_operation(block, f, 1);
 
 				if (as_obj) {
-					block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_string_type(), to_wide(prop))));
-					write_operation(block, "obj_set_property", 3);
-					block->codes.push_back(code(lex->line, script_engine::pc_pop));
+					write_property(block, prop, true);
 				}
 				else if (as_array) {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign_writable));
+					block->push_code(lex->line, code(script_engine::pc_assign_writable));
 				}
 				else {
-					block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+					block->push_code(lex->line, code(script_engine::pc_assign, s->level, s->variable));
 				}
 
 			}
@@ -2020,7 +2498,7 @@ void parser::parse_statements(script_engine::block * block)
 				if (argc != s->sub->arguments)
 					throw parser_error("Incorrect number of arguments for: " + s->sub->name);
 
-				block->codes.push_back(code(lex->line, script_engine::pc_call, s->sub, argc));
+				block->push_code(lex->line, code(script_engine::pc_call, s->sub, argc));
 			}
 		}
 		else if (lex->next == tk_LET || lex->next == tk_REAL)
@@ -2037,7 +2515,7 @@ void parser::parse_statements(script_engine::block * block)
 				lex->advance();
 
 				parse_expression(block);
-				block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+				block->push_code(lex->line, code(script_engine::pc_declare, s->level, s->variable));
 			}
 		}
 		else if (lex->next == tk_LOCAL)
@@ -2053,16 +2531,16 @@ void parser::parse_statements(script_engine::block * block)
 			{
 				parse_parentheses(block);
 				int ip = block->codes.length;
-				block->codes.push_back(code(lex->line, script_engine::pc_loop_count));
-				parse_inline_block(block, script_engine::bk_loop);
-				block->codes.push_back(code(lex->line, script_engine::pc_loop_back, ip));
-				block->codes.push_back(code(lex->line, script_engine::pc_pop));
+				block->push_code(lex->line, code(script_engine::pc_loop_count));
+				parse_loop_body(block, NULL);
+				block->push_code(lex->line, code(script_engine::pc_loop_count_back, ip));
+				block->push_code(lex->line, code(script_engine::pc_pop));
 			}
 			else
 			{
 				int ip = block->codes.length;
 				parse_inline_block(block, script_engine::bk_loop);
-				block->codes.push_back(code(lex->line, script_engine::pc_loop_back, ip));
+				block->push_code(lex->line, code(script_engine::pc_loop_back, ip));
 			}
 			need_semicolon = false;
 		}
@@ -2075,10 +2553,10 @@ void parser::parse_statements(script_engine::block * block)
 			{
 				lex->advance();
 			}
-			block->codes.push_back(code(lex->line, script_engine::pc_loop_count));
-			parse_inline_block(block, script_engine::bk_loop);
-			block->codes.push_back(code(lex->line, script_engine::pc_loop_back, ip));
-			block->codes.push_back(code(lex->line, script_engine::pc_pop));
+			block->push_code(lex->line, code(script_engine::pc_loop_count));
+			parse_loop_body(block, NULL);
+			block->push_code(lex->line, code(script_engine::pc_loop_count_back, ip));
+			block->push_code(lex->line, code(script_engine::pc_pop));
 			need_semicolon = false;
 		}
 		else if (lex->next == tk_WHILE)
@@ -2090,9 +2568,9 @@ void parser::parse_statements(script_engine::block * block)
 			{
 				lex->advance();
 			}
-			block->codes.push_back(code(lex->line, script_engine::pc_loop_if));
-			parse_inline_block(block, script_engine::bk_loop);
-			block->codes.push_back(code(lex->line, script_engine::pc_loop_back, ip));
+			block->push_code(lex->line, code(script_engine::pc_loop_if));
+			parse_loop_body(block, NULL);
+			block->push_code(lex->line, code(script_engine::pc_loop_back, ip));
 			need_semicolon = false;
 		}
 		else if (lex->next == tk_FOR)
@@ -2127,7 +2605,7 @@ void parser::parse_statements(script_engine::block * block)
 
 			if (lex->next == tk_word) {
 				// push 0 and array length
-				block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_real_type(), 0.0L)));
+				block->push_code(lex->line, literal(value(engine->get_real_type(), 0LL)));
 				parse_expression(block);
 				write_operation(block, "length", 1);
 			}
@@ -2147,56 +2625,66 @@ void parser::parse_statements(script_engine::block * block)
 
 			if (!back)
 			{
-				block->codes.push_back(code(lex->line, script_engine::pc_swap));
+				block->push_code(lex->line, code(script_engine::pc_swap));
 			}
 
 			int ip = block->codes.length;
-
-			block->codes.push_back(code(lex->line, script_engine::pc_dup2));
-			write_operation(block, "compare", 2);
-
-			block->codes.push_back(code(lex->line, back ? script_engine::pc_loop_descent : script_engine::pc_loop_ascent));
-
-			if (back)
-			{
-				write_operation(block, "predecessor", 1);
-			}
-
-			script_engine::block * b = engine->new_block(block->level + 1, script_engine::bk_loop);
 			std::vector < std::string > counter;
 			counter.push_back(s);
-			parse_block(b, &counter, false, false);
-			block->codes.push_back(code(lex->line, script_engine::pc_dup));
-			block->codes.push_back(code(lex->line, script_engine::pc_call, b, 1));
 
-			if (!back)
+			script_engine::command_kind compare, step;
+			if (search_operation("compare", compare) && compare == script_engine::pc_compare
+				&& search_operation(back ? "predecessor" : "successor", step))
 			{
-				write_operation(block, "successor", 1);
+				// The test and the step of the counter go in one code before the body and one after it
+				block->push_code(lex->line, code(back ? script_engine::pc_range_descent : script_engine::pc_range_ascent));
+				parse_loop_body(block, &counter);
+				block->push_code(lex->line, code(back ? script_engine::pc_range_descent_back : script_engine::pc_range_ascent_back, ip));
 			}
+			else
+			{
+				block->push_code(lex->line, code(script_engine::pc_dup2));
+				write_operation(block, "compare", 2);
+
+				block->push_code(lex->line, code(back ? script_engine::pc_loop_descent : script_engine::pc_loop_ascent));
+
+				if (back)
+				{
+					write_operation(block, "predecessor", 1);
+				}
+
+				block->push_code(lex->line, code(script_engine::pc_dup));
+				parse_loop_body(block, &counter);
+
+				if (!back)
+				{
+					write_operation(block, "successor", 1);
+				}
 
-			block->codes.push_back(code(lex->line, script_engine::pc_loop_back, ip));
-			block->codes.push_back(code(lex->line, script_engine::pc_pop));
-			block->codes.push_back(code(lex->line, script_engine::pc_pop));
+				block->push_code(lex->line, code(script_engine::pc_loop_back, ip));
+			}
+			block->push_code(lex->line, code(script_engine::pc_pop));
+			block->push_code(lex->line, code(script_engine::pc_pop));
 
 			need_semicolon = false;
 		}
 		else if (lex->next == tk_IF)
 		{
 			lex->advance();
-			block->codes.push_back(code(lex->line, script_engine::pc_case_begin));
+			block->push_code(lex->line, code(script_engine::pc_case_begin));
 
 			parse_parentheses(block);
-			block->codes.push_back(code(lex->line, script_engine::pc_case_if_not));
+			block->push_code(lex->line, code(script_engine::pc_case_if_not));
 			parse_inline_block(block, script_engine::bk_normal);
 			while (lex->next == tk_ELSE)
 			{
 				lex->advance();
-				block->codes.push_back(code(lex->line, script_engine::pc_case_next));
+				block->push_code(lex->line, code(script_engine::pc_case_next));
 				if (lex->next == tk_IF)
 				{
 					lex->advance();
 					parse_parentheses(block);
-					block->codes.push_back(code(lex->line, script_engine::pc_case_if_not));
+					block->push_code(lex->line, code(script_engine::pc_case_if_not));
 					parse_inline_block(block, script_engine::bk_normal);
 				}
 				else
@@ -2206,7 +2694,7 @@ void parser::parse_statements(script_engine::block * block)
 				}
 			}
 
-			block->codes.push_back(code(lex->line, script_engine::pc_case_end));
+			block->push_code(lex->line, code(script_engine::pc_case_end));
 			need_semicolon = false;
 		}
 		else if (lex->next == tk_EVENTS)
@@ -2218,37 +2706,37 @@ void parser::parse_statements(script_engine::block * block)
 				throw parser_error("Expected token: \"=>\"");
 			lex->advance();
 
-			block->codes.push_back(code(lex->line, script_engine::pc_case_begin));
+			block->push_code(lex->line, code(script_engine::pc_case_begin));
 			while (lex->next == tk_ON)
 			{
 				lex->advance();
 
 				if (lex->next != tk_open_par)
 					throw parser_error("Expected token: \"(\"");
-				block->codes.push_back(code(lex->line, script_engine::pc_case_begin));
+				block->push_code(lex->line, code(script_engine::pc_case_begin));
 				do
 				{
 					lex->advance();
 
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
+					block->push_code(lex->line, code(script_engine::pc_dup));
 					parse_expression(block);
 					write_operation(block, "compare", 2);
-					block->codes.push_back(code(lex->line, script_engine::pc_compare_e));
-					block->codes.push_back(code(lex->line, script_engine::pc_dup));
-					block->codes.push_back(code(lex->line, script_engine::pc_case_if));
-					block->codes.push_back(code(lex->line, script_engine::pc_pop));
+					block->push_code(lex->line, code(script_engine::pc_compare_e));
+					block->push_code(lex->line, code(script_engine::pc_dup));
+					block->push_code(lex->line, code(script_engine::pc_case_if));
+					block->push_code(lex->line, code(script_engine::pc_pop));
 
 				} while (lex->next == tk_comma);
-				block->codes.push_back(code(lex->line, script_engine::pc_push_value, value(engine->get_boolean_type(), false)));
-				block->codes.push_back(code(lex->line, script_engine::pc_case_end));
+				block->push_code(lex->line, literal(value(engine->get_boolean_type(), false)));
+				block->push_code(lex->line, code(script_engine::pc_case_end));
 				if (lex->next != tk_close_par)
 					throw parser_error("Expected token: \")\"");
 				lex->advance();
 
-				block->codes.push_back(code(lex->line, script_engine::pc_case_if_not));
-				block->codes.push_back(code(lex->line, script_engine::pc_pop));
+				block->push_code(lex->line, code(script_engine::pc_case_if_not));
+				block->push_code(lex->line, code(script_engine::pc_pop));
 				parse_inline_block(block, script_engine::bk_normal);
-				block->codes.push_back(code(lex->line, script_engine::pc_case_next));
+				block->push_code(lex->line, code(script_engine::pc_case_next));
 			}
 
 			if (lex->next != tk_ELSE)
@@ -2256,16 +2744,16 @@ void parser::parse_statements(script_engine::block * block)
 
 			lex->advance();
 
-			block->codes.push_back(code(lex->line, script_engine::pc_pop));
+			block->push_code(lex->line, code(script_engine::pc_pop));
 			parse_inline_block(block, script_engine::bk_normal);
 
-			block->codes.push_back(code(lex->line, script_engine::pc_case_end));
+			block->push_code(lex->line, code(script_engine::pc_case_end));
 			need_semicolon = false;
 		}
 		else if (lex->next == tk_BREAK)
 		{
 			lex->advance();
-			block->codes.push_back(code(lex->line, script_engine::pc_break_loop));
+			block->push_code(lex->line, code(script_engine::pc_break_loop));
 		}
 		else if (lex->next == tk_RETURN)
 		{
@@ -2283,19 +2771,19 @@ void parser::parse_statements(script_engine::block * block)
 				if (s == NULL)
 					throw parser_error("Attempted to return from outside a function.");
 
-				block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+				block->push_code(lex->line, code(script_engine::pc_assign, s->level, s->variable));
 			}
-			block->codes.push_back(code(lex->line, script_engine::pc_break_routine));
+			block->push_code(lex->line, code(script_engine::pc_break_routine));
 		}
 		else if (lex->next == tk_YIELD)
 		{
 			lex->advance();
-			block->codes.push_back(code(lex->line, script_engine::pc_yield));
+			block->push_code(lex->line, code(script_engine::pc_yield));
 		}
 		else if (lex->next == tk_EXIT)
 		{
 			lex->advance();
-			block->codes.push_back(code(lex->line, script_engine::pc_exit));
+			block->push_code(lex->line, code(script_engine::pc_exit));
 		}
 		else if (lex->next == tk_at || lex->next == tk_SUB || lex->next == tk_FUNCTION || lex->next == tk_TASK)
 		{
@@ -2311,7 +2799,7 @@ void parser::parse_statements(script_engine::block * block)
 			{
 				if (s->sub->level > 1)
 					throw parser_error("Machine events cannot be defined deeper than global scope.");
-				events[s->sub->name] = s->sub;
+				events[engine->get_atoms().intern(s->sub->name)] = s->sub;
 			}
 
 			lex->advance();
@@ -2368,9 +2856,68 @@ void parser::parse_statements(script_engine::block * block)
 
 void parser::parse_inline_block(script_engine::block * block, script_engine::block_kind kind)
 {
+	if (kind == script_engine::bk_normal && can_inline(false))
+	{
+		parse_inlined_body(block, kind, NULL);
+		return;
+	}
+
 	script_engine::block * b = engine->new_block(block->level + 1, kind);
 	parse_block(b, NULL, false, false);
-	block->codes.push_back(code(lex->line, script_engine::pc_call, b, 0));
+	block->push_code(lex->line, code(script_engine::pc_call, b, 0));
+}
+
+void parser::parse_loop_body(script_engine::block * block, std::vector < std::string > const * args)
+{
+	// Expects the arguments on the stack, one for each name
+	if (can_inline(true))
+	{
+		parse_inlined_body(block, script_engine::bk_loop, args);
+		return;
+	}
+
+	script_engine::block * b = engine->new_block(block->level + 1, script_engine::bk_loop);
+	parse_block(b, args, false, false);
+	block->push_code(lex->line, code(script_engine::pc_call, b, args != NULL ? args->size() : 0));
+}
+
+void parser::parse_inlined_body(script_engine::block * block, script_engine::block_kind kind, std::vector < std::string > const * args)
+{
+	// The body goes straight into the block around it, its variables take further slots of that environment
+	lex->advance();
+
+	frame.push_back(scope(kind));
+	frame.back().inlined = true;
+
+	unsigned first = block->variables;
+	scan_current_scope(block->level, args, false, false, block->variables);
+	count_variables(block);
+
+	if (args != NULL)
+	{
+		for (unsigned i = args->size(); i > 0; --i)
+		{
+			symbol * s = search((*args)[i - 1]);
+			block->push_code(lex->line, code(script_engine::pc_declare, s->level, s->variable));
+		}
+	}
+	parse_statements(block);
+
+	// The slots outlive the body, so each turn ends with them empty: the next one cannot read a value
+	// before its let and objects held there go now rather than with the environment
+	if (static_cast < unsigned > (block->variables) > first)
+	{
+		code c(script_engine::pc_clear_variables);
+		c.first_variable = first;
+		c.variable_count = block->variables - first;
+		block->push_code(lex->line, c);
+	}
+
+	frame.pop_back();
+
+	if (lex->next != tk_close_cur)
+		throw parser_error("\"}\" operator is required");
+	lex->advance();
 }
 
 void parser::parse_block(script_engine::block * block, std::vector < std::string > const * args, bool adding_result, bool finding_this)
@@ -2382,13 +2929,14 @@ void parser::parse_block(script_engine::block * block, std::vector < std::string
 	frame.push_back(scope(block->kind));
 
 	scan_current_scope(block->level, args, adding_result, finding_this);
+	count_variables(block);
 
-	symbol * t = search("this");
-	if (t != NULL 
+	scope::iterator t = frame.back().find(engine->get_atoms().intern(std::string("this")));
+	if (t != frame.back().end()
 	&& (block->kind == script_engine::bk_function 
 	||  block->kind == script_engine::bk_microthread))
 	{
-		block->codes.push_back(code(lex->line, script_engine::pc_assign, t->level, t->variable));
+		block->push_code(lex->line, code(script_engine::pc_assign, t->second.level, t->second.variable));
 	}
 
 	if (args != NULL)
@@ -2396,10 +2944,11 @@ void parser::parse_block(script_engine::block * block, std::vector < std::string
 		for (unsigned i = 0; i < args->size(); ++i)
 		{
 			symbol * s = search((*args)[i]);
-			block->codes.push_back(code(lex->line, script_engine::pc_assign, s->level, s->variable));
+			block->push_code(lex->line, code(script_engine::pc_assign, s->level, s->variable));
 		}
 	}
 	parse_statements(block);
+	resolve_jumps(block);
 
 	frame.pop_back();
 
@@ -2412,6 +2961,34 @@ void parser::parse_block(script_engine::block * block, std::vector < std::string
 
 script_engine::script_engine(script_type_manager * a_type_manager, std::string const & source, int funcc, function const * funcv) :
 	type_manager(a_type_manager)
+{
+	parse(source, funcc, funcv);
+}
+
+script_engine::script_engine(script_type_manager * a_type_manager, std::string const & source, int funcc, function const * funcv, std::string const & cache_path) :
+	type_manager(a_type_manager)
+{
+	{
+		std::ifstream input(cache_path.c_str(), std::ios::binary);
+		if (input && load_cache(input, source, funcc, funcv))
+			return;
+	}
+
+	parse(source, funcc, funcv);
+
+	if (!error)
+	{
+		bool saved;
+		{
+			std::ofstream output(cache_path.c_str(), std::ios::binary | std::ios::trunc);
+			saved = output && save_cache(output, source);
+		}
+		if (!saved)
+			std::remove(cache_path.c_str());
+	}
+}
+
+void script_engine::parse(std::string const & source, int funcc, function const * funcv)
 {
 	main_block = new_block(0, bk_normal);
 
@@ -2423,116 +3000,883 @@ script_engine::script_engine(script_type_manager * a_type_manager, std::string c
 	error = p.error;
 	error_message = p.error_message;
 	error_line = p.error_line;
-}
-
-/* script_machine */
-
-script_machine::script_machine(script_engine * the_engine)
-{
-	assert(!the_engine->get_error());
-	engine = the_engine;
 
-	first_using_environment = NULL;
-	last_using_environment = NULL;
-	first_garbage_environment = NULL;
-	last_garbage_environment = NULL;
+#if !defined(__SCRIPT_H__NO_PEEPHOLE)
+	if (!error)
+	{
+		for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
+			optimize(&*i);
+	}
+#endif
 
-	error = false;
+	mark_frames();
 }
 
-script_machine::~script_machine()
+void script_engine::mark_frames()
 {
-	while (first_using_environment != NULL)
+	// Escape analysis: an environment outlives its call only when a task started under it keeps it as a parent
+	// A block runs on a frame when it starts no tasks and calls nothing but natives and other frame blocks
+	// Every block starts as one, and blocks calling anything else drop out until nothing changes
+	for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
+		i->frame = i->kind != bk_microthread && i->func == NULL;
+
+	// Arguments go straight into the variables the first codes of the block assign them to
+	for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
 	{
-		environment * object = first_using_environment;
-		first_using_environment = first_using_environment->succ;
-		delete object;
+		for (unsigned j = 0; j < i->codes.length; ++j)
+		{
+			code & c = i->codes.at[j];
+			if (c.command != pc_call && c.command != pc_call_and_push_result)
+				continue;
+			for (unsigned k = 0; c.sub->frame && k < c.arguments; ++k)
+			{
+				if (k >= c.sub->codes.length || c.sub->codes.at[k].command != pc_assign || c.sub->codes.at[k].level != c.sub->level)
+					c.sub->frame = false;
+			}
+		}
 	}
 
-	while (first_garbage_environment != NULL)
+	bool changing = true;
+	while (changing)
 	{
-		environment * object = first_garbage_environment;
-		first_garbage_environment = first_garbage_environment->succ;
-		delete object;
+		changing = false;
+		for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
+		{
+			for (unsigned j = 0; i->frame && j < i->codes.length; ++j)
+			{
+				code & c = i->codes.at[j];
+				if ((c.command == pc_call || c.command == pc_call_and_push_result) && c.sub->func == NULL && !c.sub->frame)
+				{
+					i->frame = false;
+					changing = true;
+				}
+			}
+		}
 	}
 }
 
-script_machine::environment * script_machine::new_environment(environment * parent, script_engine::block * b)
+/* code cache */
+
+// File layout: header, then the payload: constants, blocks in list order and events
+// The header holds a hash of the payload, so a damaged file is rebuilt instead of run
+// Block pointers are written as indices into the block list
+// Bump the version whenever codes or their meaning change
+static char const cache_magic[4] = { 'F', 'A', 'E', 'C' };
+static unsigned const cache_version = 12;
+static unsigned const cache_length_limit = 1u << 28;
+
+// Codes written with the peephole pass are not what a build without it would run
+#if defined(__SCRIPT_H__NO_PEEPHOLE)
+static bool const peephole = false;
+#else
+static bool const peephole = true;
+#endif
+
+// Natives are looked up again in the table they came from
+enum cache_native
 {
-	environment * result = NULL;
+	cn_none, cn_operation, cn_client
+};
 
-	if (first_garbage_environment != NULL)
-	{
-		// garbage collection //݉
-		result = first_garbage_environment;
-		first_garbage_environment = result->succ;
-		*((result->succ != NULL) ? &result->succ->pred : &last_garbage_environment) = result->pred;
-	}
+// Type kinds, plus a marker for values without data
+static unsigned char const cache_no_type = 0xFF;
 
-	if (result == NULL)
+// FNV-1a, used to tell whether the cache was built from this source and whether its payload is intact
+static unsigned long long hash_bytes(std::string const & bytes)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < bytes.size(); ++i)
 	{
-		result = new environment;
+		h ^= static_cast < unsigned char > (bytes[i]);
+		h *= 1099511628211ULL;
 	}
+	return h;
+}
 
-	result->parent = parent;
-	result->ref_count = 1;
-	result->sub = b;
-	result->ip = 0;
-	result->variables.release();
-	result->stack.length = 0;
-	result->has_result = false;
-
-	// add to the list being used //gpXgւ̒ǉ
-	result->pred = last_using_environment;
-	result->succ = NULL;
-	*((result->pred != NULL) ? &result->pred->succ : &first_using_environment) = result;
-	last_using_environment = result;
-
-	return result;
+template < typename T >
+static void write_raw(std::ostream & stream, T const & v)
+{
+	stream.write(reinterpret_cast < char const * > (&v), sizeof(T));
 }
 
-void script_machine::dispose_environment(environment * object)
+template < typename T >
+static bool read_raw(std::istream & stream, T & v)
 {
-	assert(object->ref_count == 0);
+	return !stream.read(reinterpret_cast < char * > (&v), sizeof(T)).fail();
+}
 
-	//remove from the list in use //gpXg̍폜 
-	*((object->pred != NULL) ? &object->pred->succ : &first_using_environment) = object->succ;
-	*((object->succ != NULL) ? &object->succ->pred : &last_using_environment) = object->pred;
+static void write_string(std::ostream & stream, std::string const & s)
+{
+	write_raw(stream, static_cast < unsigned > (s.size()));
+	stream.write(s.data(), s.size());
+}
 
-	//litter added to the list //݃Xgւ̒ǉ
-	object->pred = last_garbage_environment;
-	object->succ = NULL;
-	*((object->pred != NULL) ? &object->pred->succ : &first_garbage_environment) = object;
-	last_garbage_environment = object;
+static bool read_string(std::istream & stream, std::string & s)
+{
+	unsigned length;
+	if (!read_raw(stream, length) || length > cache_length_limit)
+		return false;
+	s.resize(length);
+	return length == 0 || !stream.read(&s[0], length).fail();
 }
 
-void script_machine::run()
+static void write_type(std::ostream & stream, type_data * t)
 {
-	assert(!error);
-	if (first_using_environment == NULL)
+	if (t == NULL)
 	{
-		error_line = -1;
-		threads.clear();
-		threads.push_back(new_environment(NULL, engine->main_block));
-		current_thread_index = 0;
-		finished = false;
-		stopped = false;
-		resuming = false;
-
-		while (!finished)
-		{
-			advance();
-		}
+		write_raw(stream, cache_no_type);
+		return;
 	}
+	write_raw(stream, static_cast < unsigned char > (t->get_kind()));
+	if (t->get_kind() == type_data::tk_array)
+		write_type(stream, t->get_element());
 }
 
-void script_machine::resume()
+static bool read_type(std::istream & stream, script_type_manager * manager, type_data * & t)
 {
-	assert(!error);
-	assert(stopped);
-	stopped = false;
-	finished = false;
-	resuming = true;
+	unsigned char kind;
+	if (!read_raw(stream, kind))
+		return false;
+	switch (kind)
+	{
+	case cache_no_type:
+		t = NULL;
+		return true;
+	case type_data::tk_real:
+		t = manager->get_real_type();
+		return true;
+	case type_data::tk_char:
+		t = manager->get_char_type();
+		return true;
+	case type_data::tk_boolean:
+		t = manager->get_boolean_type();
+		return true;
+	case type_data::tk_object:
+		t = manager->get_object_type();
+		return true;
+	case type_data::tk_array:
+	{
+		type_data * element;
+		if (!read_type(stream, manager, element) || element == NULL)
+			return false;
+		t = manager->get_array_type(element);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Constants are literals: reals, characters, booleans, strings and empty objects
+static void write_value(std::ostream & stream, value const & v)
+{
+	type_data * t = v.get_type();
+	write_type(stream, t);
+	if (t == NULL)
+		return;
+	switch (t->get_kind())
+	{
+	case type_data::tk_real:
+		write_raw(stream, v.as_real());
+		break;
+	case type_data::tk_char:
+		write_raw(stream, static_cast < unsigned > (v.as_char()));
+		break;
+	case type_data::tk_boolean:
+		write_raw(stream, static_cast < unsigned char > (v.as_boolean()));
+		break;
+	case type_data::tk_array:
+		write_raw(stream, v.length_as_array());
+		for (unsigned i = 0; i < v.length_as_array(); ++i)
+			write_value(stream, v.index_as_array(i));
+		break;
+	default:
+		break;
+	}
+}
+
+static bool read_value(std::istream & stream, script_type_manager * manager, value & v)
+{
+	type_data * t;
+	if (!read_type(stream, manager, t))
+		return false;
+	if (t == NULL)
+	{
+		v = value();
+		return true;
+	}
+	switch (t->get_kind())
+	{
+	case type_data::tk_real:
+	{
+		real_t r;
+		if (!read_raw(stream, r))
+			return false;
+		v = value::make_number(t, r);
+		return true;
+	}
+	case type_data::tk_char:
+	{
+		unsigned c;
+		if (!read_raw(stream, c))
+			return false;
+		v = value(t, static_cast < wchar_t > (c));
+		return true;
+	}
+	case type_data::tk_boolean:
+	{
+		unsigned char b;
+		if (!read_raw(stream, b))
+			return false;
+		v = value(t, b != 0);
+		return true;
+	}
+	case type_data::tk_array:
+	{
+		unsigned length;
+		if (!read_raw(stream, length) || length > cache_length_limit)
+			return false;
+		v = value(t, std::wstring());
+		for (unsigned i = 0; i < length; ++i)
+		{
+			value element;
+			if (!read_value(stream, manager, element))
+				return false;
+			v.append(t, element);
+		}
+		return true;
+	}
+	default:
+		v = value(t);
+		return true;
+	}
+}
+
+// Calls and built-in operators hold a block in the code, every other code holds level/variable or ip
+static bool code_uses_sub(script_engine::command_kind command)
+{
+	return command == script_engine::pc_call || command == script_engine::pc_call_and_push_result
+		|| (command >= script_engine::pc_add && command <= script_engine::pc_concatenate);
+}
+
+// Property codes hold an atom, which only means something in the process that interned it, so the name is written instead
+static bool code_uses_atom(script_engine::command_kind command)
+{
+	return command == script_engine::pc_get_property || command == script_engine::pc_set_property
+		|| command == script_engine::pc_modify_property;
+}
+
+bool script_engine::save_cache(std::ostream & output, std::string const & source)
+{
+	std::ostringstream stream(std::ios::binary);
+
+	std::map < block *, unsigned > indices;
+	for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		unsigned index = indices.size();
+		indices[&*i] = index;
+	}
+
+	write_raw(stream, constants.length);
+	for (unsigned i = 0; i < constants.length; ++i)
+		write_value(stream, constants.at[i]);
+
+	write_raw(stream, static_cast < unsigned > (blocks.size()));
+	write_raw(stream, indices[main_block]);
+
+	for (std::list < block >::iterator i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		block & b = *i;
+		write_raw(stream, b.level);
+		write_raw(stream, b.arguments);
+		write_string(stream, b.name);
+		write_raw(stream, static_cast < int > (b.kind));
+		write_raw(stream, b.break_ip);
+		write_raw(stream, b.variables);
+
+		int native = cn_none;
+		if (b.func != NULL)
+		{
+			native = cn_client;
+			for (unsigned j = 0; j < sizeof(operations) / sizeof(function); ++j)
+			{
+				if (operations[j].func == b.func && b.name == operations[j].name)
+					native = cn_operation;
+			}
+		}
+		write_raw(stream, native);
+
+		write_raw(stream, b.codes.length);
+		for (unsigned j = 0; j < b.codes.length; ++j)
+		{
+			code & c = b.codes.at[j];
+			write_raw(stream, static_cast < int > (c.command));
+			write_raw(stream, b.lines.at[j]);
+			if (code_uses_atom(c.command))
+				write_string(stream, to_mbcs(get_atoms().name(c.atom)));
+			else
+				write_raw(stream, c.constant);
+			if (code_uses_sub(c.command))
+			{
+				write_raw(stream, indices[c.sub]);
+				write_raw(stream, c.arguments);
+			}
+			else if (c.command == pc_modify_element || c.command == pc_modify_property || c.command == pc_comparison)
+				write_raw(stream, static_cast < int > (c.operation));
+			else
+			{
+				write_raw(stream, c.level);
+				write_raw(stream, c.variable);
+			}
+		}
+	}
+
+	write_raw(stream, static_cast < unsigned > (events.size()));
+	for (std::map < unsigned, block * >::iterator i = events.begin(); i != events.end(); ++i)
+	{
+		write_string(stream, i->second->name);
+		write_raw(stream, indices[i->second]);
+	}
+
+	if (stream.fail())
+		return false;
+	std::string payload = stream.str();
+	output.write(cache_magic, sizeof(cache_magic));
+	write_raw(output, cache_version);
+	write_raw(output, static_cast < unsigned char > (sizeof(real_t)));
+	write_raw(output, peephole);
+	write_raw(output, hash_bytes(source));
+	write_raw(output, hash_bytes(payload));
+	output.write(payload.data(), payload.size());
+	return !output.fail();
+}
+
+bool script_engine::load_cache(std::istream & input, std::string const & source, int funcc, function const * funcv)
+{
+	char magic[sizeof(cache_magic)];
+	unsigned version;
+	unsigned char real_size;
+	bool optimized;
+	unsigned long long hash;
+	unsigned long long payload_hash;
+	if (input.read(magic, sizeof(magic)).fail() || std::memcmp(magic, cache_magic, sizeof(magic)) != 0
+		|| !read_raw(input, version) || version != cache_version
+		|| !read_raw(input, real_size) || real_size != sizeof(real_t)
+		|| !read_raw(input, optimized) || optimized != peephole
+		|| !read_raw(input, hash) || hash != hash_bytes(source)
+		|| !read_raw(input, payload_hash))
+		return false;
+
+	// The codes are trusted once read, so the whole payload is checked before any of it is parsed
+	std::ostringstream rest(std::ios::binary);
+	rest << input.rdbuf();
+	std::string payload = rest.str();
+	if (hash_bytes(payload) != payload_hash)
+		return false;
+	std::istringstream stream(payload, std::ios::binary);
+
+	unsigned constant_count;
+	if (!read_raw(stream, constant_count) || constant_count > cache_length_limit)
+		return false;
+	for (unsigned i = 0; i < constant_count; ++i)
+	{
+		value v;
+		if (!read_value(stream, type_manager, v))
+		{
+			constants.release();
+			return false;
+		}
+		constants.push_back(v);
+	}
+
+	unsigned count;
+	unsigned main_index;
+	if (!read_raw(stream, count) || count > cache_length_limit || !read_raw(stream, main_index) || main_index >= count)
+		return false;
+
+	std::map < std::string, function const * > operation_table;
+	for (unsigned i = 0; i < sizeof(operations) / sizeof(function); ++i)
+		operation_table[operations[i].name] = &operations[i];
+	std::map < std::string, function const * > client_table;
+	for (int i = 0; i < funcc; ++i)
+		client_table[funcv[i].name] = &funcv[i];
+
+	std::vector < block * > table;
+	for (unsigned i = 0; i < count; ++i)
+		table.push_back(new_block(0, bk_normal));
+
+	bool loaded = true;
+	for (unsigned i = 0; loaded && i < count; ++i)
+	{
+		block & b = *table[i];
+		int kind;
+		int native;
+		unsigned length;
+		loaded = read_raw(stream, b.level) && read_raw(stream, b.arguments) && read_string(stream, b.name)
+			&& read_raw(stream, kind) && read_raw(stream, b.break_ip) && read_raw(stream, b.variables) && read_raw(stream, native)
+			&& read_raw(stream, length) && length <= cache_length_limit;
+		if (!loaded)
+			break;
+		b.kind = static_cast < block_kind > (kind);
+
+		if (native != cn_none)
+		{
+			// Calls in the cache pass the argument count the native had when it was written
+			std::map < std::string, function const * > & natives = (native == cn_operation) ? operation_table : client_table;
+			std::map < std::string, function const * >::iterator f = natives.find(b.name);
+			if (f == natives.end() || static_cast < int > (f->second->arguments) != b.arguments)
+			{
+				loaded = false;
+				break;
+			}
+			b.func = f->second->func;
+		}
+
+		for (unsigned j = 0; loaded && j < length; ++j)
+		{
+			code c;
+			int command;
+			int line;
+			loaded = read_raw(stream, command) && command >= 0 && command <= pc_return && read_raw(stream, line);
+			if (!loaded)
+				break;
+			c.command = static_cast < command_kind > (command);
+			if (code_uses_atom(c.command))
+			{
+				std::string name;
+				loaded = read_string(stream, name);
+				c.atom = get_atoms().intern(name);
+			}
+			else
+				loaded = read_raw(stream, c.constant) && (c.command != pc_push_value || c.constant < constants.length);
+			if (!loaded)
+				break;
+			if (code_uses_sub(c.command))
+			{
+				unsigned sub;
+				loaded = read_raw(stream, sub) && sub < count && read_raw(stream, c.arguments);
+				if (loaded)
+					c.sub = table[sub];
+			}
+			else if (c.command == pc_modify_element || c.command == pc_modify_property)
+			{
+				int operation;
+				loaded = read_raw(stream, operation) && operation >= pc_add && operation <= pc_concatenate;
+				c.operation = static_cast < command_kind > (operation);
+			}
+			else if (c.command == pc_comparison)
+			{
+				int operation;
+				loaded = read_raw(stream, operation) && operation >= pc_compare_e && operation <= pc_compare_ne;
+				c.operation = static_cast < command_kind > (operation);
+			}
+			else
+				loaded = read_raw(stream, c.level) && read_raw(stream, c.variable);
+			if (c.command == pc_get_property || c.command == pc_set_property
+				|| c.command == pc_modify_element || c.command == pc_modify_property)
+			{
+				// inline caches hold shapes of the process that wrote the file
+				c.cached_shape = NULL;
+				c.cached_slot = 0;
+			}
+			if (loaded)
+				b.push_code(line, c);
+		}
+	}
+
+	unsigned event_count;
+	loaded = loaded && read_raw(stream, event_count) && event_count <= count;
+	for (unsigned i = 0; loaded && i < event_count; ++i)
+	{
+		std::string name;
+		unsigned index;
+		loaded = read_string(stream, name) && read_raw(stream, index) && index < count;
+		if (loaded)
+			events[get_atoms().intern(name)] = table[index];
+	}
+
+	if (!loaded)
+	{
+		blocks.clear();
+		events.clear();
+		constants.release();
+		return false;
+	}
+
+	main_block = table[main_index];
+	error = false;
+	error_line = 0;
+	mark_frames();
+	return true;
+}
+
+/* slab_allocator */
+
+slab_allocator::slab_allocator()
+{
+	for (std::size_t i = 0; i < classes; ++i)
+		free_blocks[i] = NULL;
+}
+
+slab_allocator::~slab_allocator()
+{
+	for (unsigned i = 0; i < slabs.length; ++i)
+		::operator delete(slabs.at[i]);
+}
+
+void * slab_allocator::allocate(std::size_t size)
+{
+	if (size == 0 || size > granularity * classes)
+		return ::operator new(size);
+
+	std::size_t c = (size - 1) / granularity;
+	if (free_blocks[c] == NULL)
+		refill(c);
+	free_block * result = free_blocks[c];
+	free_blocks[c] = result->next;
+	return result;
+}
+
+void slab_allocator::deallocate(void * p, std::size_t size)
+{
+	if (size == 0 || size > granularity * classes)
+	{
+		::operator delete(p);
+		return;
+	}
+
+	std::size_t c = (size - 1) / granularity;
+	free_block * b = static_cast < free_block * > (p);
+	b->next = free_blocks[c];
+	free_blocks[c] = b;
+}
+
+void slab_allocator::refill(std::size_t c)
+{
+	std::size_t block_size = (c + 1) * granularity;
+	char * slab = static_cast < char * > (::operator new(slab_size));
+	slabs.push_back(slab);
+	for (std::size_t offset = 0; offset + block_size <= slab_size; offset += block_size)
+	{
+		free_block * b = reinterpret_cast < free_block * > (slab + offset);
+		b->next = free_blocks[c];
+		free_blocks[c] = b;
+	}
+}
+
+/* script_machine */
+
+script_machine::script_machine(script_engine * the_engine)
+{
+	assert(!the_engine->get_error());
+	engine = the_engine;
+	allocator = engine->get_type_manager()->get_allocator();
+
+	first_using_environment = NULL;
+	last_using_environment = NULL;
+	first_garbage_environment = NULL;
+	last_garbage_environment = NULL;
+
+	first_thread = NULL;
+	last_thread = NULL;
+	first_garbage_thread = NULL;
+	current_thread = NULL;
+
+	frame_count = 0;
+	sleep_frames = 0;
+	code_count = 0;
+
+	error = false;
+}
+
+script_machine::~script_machine()
+{
+	while (first_using_environment != NULL)
+	{
+		environment * object = first_using_environment;
+		first_using_environment = first_using_environment->succ;
+		free_environment(object);
+	}
+
+	while (first_garbage_environment != NULL)
+	{
+		environment * object = first_garbage_environment;
+		first_garbage_environment = first_garbage_environment->succ;
+		free_environment(object);
+	}
+
+	wake_all_threads();
+	while (first_thread != NULL)
+	{
+		thread * object = first_thread;
+		first_thread = first_thread->succ;
+		free_thread(object);
+	}
+
+	while (first_garbage_thread != NULL)
+	{
+		thread * object = first_garbage_thread;
+		first_garbage_thread = first_garbage_thread->succ;
+		free_thread(object);
+	}
+}
+
+script_machine::environment * script_machine::new_environment(environment * parent, script_engine::block * b)
+{
+	environment * result = NULL;
+
+	if (first_garbage_environment != NULL)
+	{
+		// garbage collection //݉
+		result = first_garbage_environment;
+		first_garbage_environment = result->succ;
+		*((result->succ != NULL) ? &result->succ->pred : &last_garbage_environment) = result->pred;
+	}
+
+	if (result == NULL)
+	{
+		result = new (allocator) environment(allocator);
+	}
+
+	prepare_environment(result, parent, b);
+	result->frame = false;
+
+	// add to the list being used //gpXgւ̒ǉ
+	result->pred = last_using_environment;
+	result->succ = NULL;
+	*((result->pred != NULL) ? &result->pred->succ : &first_using_environment) = result;
+	last_using_environment = result;
+
+	return result;
+}
+
+script_machine::environment * script_machine::new_frame(environment * parent, script_engine::block * b)
+{
+	// Frames of a thread are given back in the order they were taken, so they need no lists
+	thread * t = current_thread;
+	if (t->frame_depth == t->frames.length)
+		t->frames.push_back(new (allocator) environment(allocator));
+	environment * result = t->frames.at[t->frame_depth];
+	++(t->frame_depth);
+
+	prepare_environment(result, parent, b);
+	result->frame = true;
+	return result;
+}
+
+void script_machine::dispose_frame(environment * object)
+{
+	assert(object->ref_count == 0);
+	assert(current_thread->frame_depth > 0 && current_thread->frames.at[current_thread->frame_depth - 1] == object);
+
+	for (unsigned i = 0; i < object->variables.length; ++i)
+		object->variables.at[i] = value();
+	object->variables.length = 0;
+
+	--(current_thread->frame_depth);
+}
+
+void script_machine::prepare_environment(environment * result, environment * parent, script_engine::block * b)
+{
+	result->parent = parent;
+	result->ref_count = 1;
+	result->sub = b;
+	result->ip = 0;
+	while (result->variables.capacity < static_cast < unsigned > (b->variables))
+		result->variables.expand();
+	result->stack.length = 0;
+	result->has_result = false;
+
+	// the display holds the enclosing environment of every level down to the global one
+	// a block is only visible inside its enclosing scope, so the caller's display already holds every outer level
+	result->display.length = 0;
+	if (parent != NULL)
+	{
+		assert(static_cast < unsigned > (b->level) <= parent->display.length);
+		for (int i = 0; i < b->level; ++i)
+			result->display.push_back(parent->display.at[i]);
+	}
+	result->display.push_back(result);
+}
+
+void script_machine::dispose_environment(environment * object)
+{
+	assert(object->ref_count == 0);
+
+	// drop the variables now, the storage stays for the next environment
+	for (unsigned i = 0; i < object->variables.length; ++i)
+		object->variables.at[i] = value();
+	object->variables.length = 0;
+
+	//remove from the list in use //gpXg̍폜 
+	*((object->pred != NULL) ? &object->pred->succ : &first_using_environment) = object->succ;
+	*((object->succ != NULL) ? &object->succ->pred : &last_using_environment) = object->pred;
+
+	//litter added to the list //݃Xgւ̒ǉ
+	object->pred = last_garbage_environment;
+	object->succ = NULL;
+	*((object->pred != NULL) ? &object->pred->succ : &first_garbage_environment) = object;
+	last_garbage_environment = object;
+}
+
+void script_machine::free_environment(environment * object)
+{
+	object->~environment();
+	allocator->deallocate(object, sizeof(environment));
+}
+
+script_machine::thread * script_machine::new_thread(thread * launcher, environment * e)
+{
+	thread * result = first_garbage_thread;
+
+	if (result != NULL)
+		first_garbage_thread = result->succ;
+	else
+		result = new thread;
+
+	result->current = e;
+	result->wake_frame = 0;
+	result->parked = false;
+
+	// link right after the launcher, or as the only thread
+	result->pred = launcher;
+	result->succ = (launcher != NULL) ? launcher->succ : NULL;
+	*((result->pred != NULL) ? &result->pred->succ : &first_thread) = result;
+	*((result->succ != NULL) ? &result->succ->pred : &last_thread) = result;
+
+	result->order_pred = launcher;
+	result->order_succ = (launcher != NULL) ? launcher->order_succ : NULL;
+	if (result->order_pred != NULL)
+		result->order_pred->order_succ = result;
+	if (result->order_succ != NULL)
+		result->order_succ->order_pred = result;
+
+	return result;
+}
+
+void script_machine::dispose_thread(thread * object)
+{
+	assert(!object->parked);
+	*((object->pred != NULL) ? &object->pred->succ : &first_thread) = object->succ;
+	*((object->succ != NULL) ? &object->succ->pred : &last_thread) = object->pred;
+	if (object->order_pred != NULL)
+		object->order_pred->order_succ = object->order_succ;
+	if (object->order_succ != NULL)
+		object->order_succ->order_pred = object->order_pred;
+
+	// finished threads are kept for reuse in a singly linked list
+	object->succ = first_garbage_thread;
+	first_garbage_thread = object;
+}
+
+void script_machine::free_thread(thread * object)
+{
+	for (unsigned i = 0; i < object->frames.length; ++i)
+		free_environment(object->frames.at[i]);
+	delete object;
+}
+
+void script_machine::park_thread(thread * object)
+{
+	// the main thread ends the frames, so it is never parked
+	assert(object != first_thread && !object->parked);
+	*((object->pred != NULL) ? &object->pred->succ : &first_thread) = object->succ;
+	*((object->succ != NULL) ? &object->succ->pred : &last_thread) = object->pred;
+	object->parked = true;
+
+	sleeper s;
+	s.wake_frame = object->wake_frame;
+	s.sleeping = object;
+	sleepers.push_back(s);
+	std::push_heap(sleepers.at, sleepers.at + sleepers.length, sleeper::wakes_later);
+}
+
+void script_machine::wake_threads()
+{
+	while (sleepers.length > 0 && sleepers.at[0].wake_frame <= frame_count)
+	{
+		thread * waking = sleepers.at[0].sleeping;
+		std::pop_heap(sleepers.at, sleepers.at + sleepers.length, sleeper::wakes_later);
+		sleepers.pop_back();
+		if (!waking->parked)
+			continue;	// went back with a thread after it
+
+		// Find the nearest thread before it in the run order that is in the list,
+		// then put back every thread of this frame from there on, so each is passed once
+		thread * p = waking->order_pred;
+		while (p->parked)
+			p = p->order_pred;
+		for (thread * i = p->order_succ; ; i = i->order_succ)
+		{
+			if (i->parked && i->wake_frame <= frame_count)
+			{
+				i->parked = false;
+				i->pred = p;
+				i->succ = p->succ;
+				p->succ = i;
+				*((i->succ != NULL) ? &i->succ->pred : &last_thread) = i;
+				p = i;
+			}
+			if (i == waking)
+				break;
+		}
+	}
+}
+
+void script_machine::wake_all_threads()
+{
+	// Back into the list at its end, for clearing every thread
+	for (unsigned i = 0; i < sleepers.length; ++i)
+	{
+		thread * waking = sleepers.at[i].sleeping;
+		waking->parked = false;
+		waking->pred = last_thread;
+		waking->succ = NULL;
+		*((waking->pred != NULL) ? &waking->pred->succ : &first_thread) = waking;
+		last_thread = waking;
+	}
+	sleepers.clear();
+}
+
+void script_machine::sleep(unsigned long long frames)
+{
+	// the main thread ends the frames, so it cannot sleep through them
+	if (current_thread == first_thread)
+		raise_error("sleep can only be used in a task");
+	else
+		sleep_frames = frames;
+}
+
+void script_machine::run()
+{
+	assert(!error);
+	if (first_using_environment == NULL)
+	{
+		error_line = -1;
+		wake_all_threads();
+		while (first_thread != NULL)
+			dispose_thread(first_thread);
+		current_thread = new_thread(NULL, new_environment(NULL, engine->main_block));
+		frame_count = 0;
+		sleep_frames = 0;
+		finished = false;
+		stopped = false;
+		resuming = false;
+
+		while (!finished)
+		{
+			advance();
+		}
+	}
+}
+
+void script_machine::resume()
+{
+	assert(!error);
+	assert(stopped);
+	stopped = false;
+	finished = false;
+	resuming = true;
 	while (!finished)
 	{
 		advance();
@@ -2543,13 +3887,15 @@ void script_machine::call(std::string event_name)
 {
 	assert(!error);
 	assert(!stopped);
-	if (engine->events.find(event_name) != engine->events.end())
+	int atom = engine->get_atoms().find(event_name);
+	std::map < unsigned, script_engine::block * >::iterator found = (atom >= 0) ? engine->events.find(atom) : engine->events.end();
+	if (found != engine->events.end())
 	{
 		run();	//Ô -//just in case
 
-		script_engine::block * event = engine->events[event_name]; //event is not a keyword
-		++(threads[0]->ref_count);
-		threads[0] = new_environment(threads[0], event);
+		script_engine::block * event = found->second; //event is not a keyword
+		++(first_thread->current->ref_count);
+		first_thread->current = new_environment(first_thread->current, event);
 		finished = false;
 		while (!finished)
 		{
@@ -2561,120 +3907,644 @@ void script_machine::call(std::string event_name)
 bool script_machine::has_event(std::string event_name)
 {
 	assert(!error);
-	return engine->events.find(event_name) != engine->events.end();
+	int atom = engine->get_atoms().find(event_name);
+	return atom >= 0 && engine->events.find(atom) != engine->events.end();
 }
 
+// ip is already past the code being executed, -1 before the first code runs
 int script_machine::get_current_line()
 {
-	environment * current = threads.at[current_thread_index];
-	script_engine::code * c = &(current->sub->codes.at[current->ip]);
-	return c->line;
+	environment * current = current_thread->current;
+	if (current->ip == 0 || current->ip > current->sub->lines.length)
+		return -1;
+	return current->sub->lines.at[current->ip - 1];
 }
 
-void script_machine::advance()
+// Applies an operator code to reals, unary operators ignore b
+static real_t real_operation(script_engine::command_kind operation, real_t a, real_t b)
 {
-	assert(current_thread_index < threads.length);
-	environment * current = threads.at[current_thread_index];
+	switch (operation)
+	{
+	case script_engine::pc_add:
+		return a + b;
+	case script_engine::pc_subtract:
+		return a - b;
+	case script_engine::pc_multiply:
+		return a * b;
+	case script_engine::pc_divide:
+		return a / b;
+	case script_engine::pc_remainder:
+		return std::fmod(a, b);
+	case script_engine::pc_power:
+		return std::pow(a, b);
+	case script_engine::pc_successor:
+		return a + 1;
+	case script_engine::pc_predecessor:
+		return a - 1;
+	default:
+		assert(false);
+		return 0;
+	}
+}
 
-	if (current->ip >= current->sub->codes.length)
+// Applies an operator code to reals held as integers, unary operators ignore b
+// Fails when the result is not a whole number within integer_limit, or is a negative zero as a real
+static inline bool integer_operation(script_engine::command_kind operation, long long a, long long b, long long & r)
+{
+	switch (operation)
 	{
-		environment * removing = current;
-		current = current->parent;
-		if (current == NULL)
-		{
-			finished = true;
-		}
+	case script_engine::pc_add:
+		r = a + b;
+		break;
+	case script_engine::pc_subtract:
+		r = a - b;
+		break;
+	case script_engine::pc_multiply:
+		if (a > 0x7fffffffLL || a < -0x7fffffffLL || b > 0x7fffffffLL || b < -0x7fffffffLL)
+			return false;
+		r = a * b;
+		if (r == 0 && (a < 0 || b < 0))
+			return false;
+		break;
+	case script_engine::pc_divide:
+		if (b == 0 || a % b != 0 || (a == 0 && b < 0))
+			return false;
+		r = a / b;
+		break;
+	case script_engine::pc_remainder:
+		if (b == 0)
+			return false;
+		r = a % b;
+		if (r == 0 && a < 0)
+			return false;
+		break;
+	case script_engine::pc_compare:
+		r = (a == b) ? 0 : (a < b) ? -1 : 1;
+		break;
+	case script_engine::pc_negative:
+		if (a == 0)
+			return false;
+		r = -a;
+		break;
+	case script_engine::pc_successor:
+		r = a + 1;
+		break;
+	case script_engine::pc_predecessor:
+		r = a - 1;
+		break;
+	default:
+		return false;
+	}
+	return r >= -value::integer_limit && r <= value::integer_limit;
+}
+
+// Steps the counter of a range loop in place, through the built-in operators when it is not a real
+static void step_range(script_machine * machine, value * counter, bool ascent)
+{
+	long long r;
+	if (counter->is_integer() && integer_operation(ascent ? script_engine::pc_successor : script_engine::pc_predecessor,
+		counter->get_integer(), 0, r))
+		counter->set(counter->get_type(), r);
+	else if (counter->get_type()->get_kind() == type_data::tk_real)
+		counter->set(counter->get_type(), counter->get_real() + (ascent ? 1 : -1));
+	else
+		*counter = (ascent ? successor : predecessor)(machine, 1, counter);
+}
+
+// Checks that a range loop goes on, argv holds the bound and the counter
+static bool in_range(script_machine * machine, value const * argv, bool ascent)
+{
+	int r;
+	if (argv[0].is_integer() && argv[1].is_integer())
+		r = (argv[0].get_integer() == argv[1].get_integer()) ? 0 : (argv[0].get_integer() < argv[1].get_integer()) ? -1 : 1;
+	else if (argv[0].get_type() == argv[1].get_type() && argv[0].get_type()->get_kind() == type_data::tk_real)
+		r = (argv[0].get_real() == argv[1].get_real()) ? 0 : (argv[0].get_real() < argv[1].get_real()) ? -1 : 1;
+	else
+		r = static_cast < int > (compare(machine, 2, argv).as_real());
+	return ascent ? r > 0 : r < 0;
+}
+
+// Checks that src may replace dest in a variable or an array element
+// Empty arrays of another type are only taken over by strings
+static bool assignable(value const & dest, value const & src)
+{
+	return !dest.has_data() || dest.get_type() == src.get_type()
+		|| (dest.get_type()->get_kind() == type_data::tk_array
+			&& src.get_type()->get_kind() == type_data::tk_array
+			&& (dest.length_as_array() == 0 || src.length_as_array() == 0)
+			&& dest.get_type()->get_element()->get_kind() != type_data::tk_char
+			&& src.get_type()->get_element()->get_kind() == type_data::tk_char);
+}
+
+/* peephole pass */
+
+// Codes holding a destination in ip, the back codes of counted and range loops jump just past theirs
+static bool code_jumps(script_engine::command_kind command)
+{
+	switch (command)
+	{
+	case script_engine::pc_case_if:
+	case script_engine::pc_case_if_not:
+	case script_engine::pc_case_next:
+	case script_engine::pc_loop_ascent:
+	case script_engine::pc_loop_back:
+	case script_engine::pc_loop_count:
+	case script_engine::pc_loop_descent:
+	case script_engine::pc_loop_if:
+	case script_engine::pc_range_ascent:
+	case script_engine::pc_range_descent:
+	case script_engine::pc_range_ascent_back:
+	case script_engine::pc_range_descent_back:
+	case script_engine::pc_loop_count_back:
+	case script_engine::pc_and_then:
+	case script_engine::pc_or_else:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Computes an operator code over literals the way the machine would, false when it would call a native or fail
+static bool fold_operation(script_engine * engine, script_engine::code const & c, value const * argv, value & result)
+{
+	type_data * real_type = engine->get_real_type();
+	long long r;
+	switch (c.command)
+	{
+	case script_engine::pc_add:
+	case script_engine::pc_subtract:
+	case script_engine::pc_multiply:
+	case script_engine::pc_divide:
+	case script_engine::pc_remainder:
+	case script_engine::pc_power:
+		if (argv[0].get_type() != real_type || argv[1].get_type() != real_type)
+			return false;
+		if (argv[0].is_integer() && argv[1].is_integer() && integer_operation(c.command, argv[0].get_integer(), argv[1].get_integer(), r))
+			result = value(real_type, r);
 		else
+			result = value(real_type, real_operation(c.command, argv[0].get_real(), argv[1].get_real()));
+		return true;
+
+	case script_engine::pc_compare:
+		if (argv[0].get_type() != real_type || argv[1].get_type() != real_type)
+			return false;
+		result = value(real_type, static_cast < real_t > ((argv[0].get_real() == argv[1].get_real()) ? 0
+			: (argv[0].get_real() < argv[1].get_real()) ? -1 : 1));
+		return true;
+
+	case script_engine::pc_negative:
+	case script_engine::pc_successor:
+	case script_engine::pc_predecessor:
+		if (argv[0].get_type() != real_type)
+			return false;
+		if (argv[0].is_integer() && integer_operation(c.command, argv[0].get_integer(), 0, r))
+			result = value(real_type, r);
+		else if (c.command == script_engine::pc_negative)
+			result = value(real_type, -argv[0].get_real());
+		else
+			result = value(real_type, real_operation(c.command, argv[0].get_real(), 0));
+		return true;
+
+	case script_engine::pc_compare_e:
+	case script_engine::pc_compare_g:
+	case script_engine::pc_compare_ge:
+	case script_engine::pc_compare_l:
+	case script_engine::pc_compare_le:
+	case script_engine::pc_compare_ne:
+	{
+		if (argv[0].get_type() != real_type)
+			return false;
+		real_t t = argv[0].get_real();
+		bool b = (c.command == script_engine::pc_compare_e) ? t == 0 : (c.command == script_engine::pc_compare_g) ? t > 0
+			: (c.command == script_engine::pc_compare_ge) ? t >= 0 : (c.command == script_engine::pc_compare_l) ? t < 0
+			: (c.command == script_engine::pc_compare_le) ? t <= 0 : t != 0;
+		result = value(engine->get_boolean_type(), b);
+		return true;
+	}
+
+	case script_engine::pc_concatenate:
+		if (argv[0].get_type()->get_kind() != type_data::tk_array || argv[1].get_type()->get_kind() != type_data::tk_array
+			|| (argv[0].length_as_array() > 0 && argv[1].length_as_array() > 0 && argv[0].get_type() != argv[1].get_type()))
+			return false;
+		result = argv[0];
+		result.concatenate(argv[1]);
+		return true;
+
+	case script_engine::pc_call_and_push_result:
+		// array literals are built by appending each element
+		if (c.sub->func != append || argv[0].get_type()->get_kind() != type_data::tk_array
+			|| (argv[0].length_as_array() > 0 && argv[0].get_type()->get_element() != argv[1].get_type()))
+			return false;
+		result = argv[0];
+		result.append(engine->get_array_type(argv[1].get_type()), argv[1]);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+void script_engine::optimize(block * b)
+{
+	// Runs once jumps are resolved: every destination is an index held by a code or by break_ip of a loop block,
+	// so codes can go or merge as long as no jump lands inside a merged run
+	unsigned length = b->codes.length;
+	std::vector < bool > target(length + 1, false);
+	for (unsigned i = 0; i < length; ++i)
+	{
+		code const & c = b->codes.at[i];
+		if (c.command == pc_range_ascent_back || c.command == pc_range_descent_back || c.command == pc_loop_count_back)
+			target[c.ip + 1] = true;
+		else if (code_jumps(c.command))
+			target[c.ip] = true;
+		else if ((c.command == pc_call || c.command == pc_call_and_push_result) && c.sub->kind == bk_loop)
+			target[c.sub->break_ip] = true;
+	}
+
+	// Rewritten codes go to out with their lines, map holds where each old code went, landing marks codes jumps land on
+	lightweight_vector < code > out;
+	lightweight_vector < int > lines;
+	std::vector < unsigned > map(length + 1, 0);
+	std::vector < bool > landing;
+	bool pending = false;
+	for (unsigned i = 0; i <= length; ++i)
+	{
+		map[i] = out.length;
+		pending = pending || target[i];
+		if (i == length)
+			break;
+
+		code const & c = b->codes.at[i];
+		if (c.command == pc_case_begin || c.command == pc_case_end)
+			continue;	// markers for resolve_jumps only
+		out.push_back(c);
+		lines.push_back(b->lines.at[i]);
+		landing.push_back(pending);
+		pending = false;
+
+		// Apply rules at the end of out until none fits, a run only merges when no jump lands past its first code
+		for (bool changed = true; changed; )
 		{
-			threads[current_thread_index] = current;
+			changed = false;
+			unsigned n = out.length;
+			code * tail = &out.at[n - 1];
+			bool joined2 = n >= 2 && !landing[n - 1];
+			bool joined3 = joined2 && n >= 3 && !landing[n - 2];
+
+			// literal operands folded into one push
+			if (joined3 && out.at[n - 3].command == pc_push_value && out.at[n - 2].command == pc_push_value
+				&& ((tail->command >= pc_add && tail->command <= pc_compare) || tail->command == pc_concatenate
+					|| (tail->command == pc_call_and_push_result && tail->arguments == 2)))
+			{
+				// constants are never shared between codes, so the left one takes the result
+				value argv[2] = { constants.at[out.at[n - 3].constant], constants.at[out.at[n - 2].constant] };
+				value result;
+				if (fold_operation(this, *tail, argv, result))
+				{
+					constants.at[out.at[n - 3].constant] = result;
+					out.length = n - 2;
+					changed = true;
+					continue;
+				}
+			}
+			if (joined2 && out.at[n - 2].command == pc_push_value
+				&& ((tail->command >= pc_negative && tail->command <= pc_predecessor)
+					|| (tail->command >= pc_compare_e && tail->command <= pc_compare_ne)))
+			{
+				value result;
+				if (fold_operation(this, *tail, &constants.at[out.at[n - 2].constant], result))
+				{
+					constants.at[out.at[n - 2].constant] = result;
+					out.length = n - 1;
+					changed = true;
+					continue;
+				}
+			}
+
+			// pushes dropped right away
+			if (joined2 && tail->command == pc_pop && (out.at[n - 2].command == pc_push_value || out.at[n - 2].command == pc_dup))
+			{
+				pending = landing[n - 2];	// jumps to the pair land on the next code
+				out.length = n - 2;
+				changed = true;
+				continue;
+			}
+
+			// two literals swapped after pushing are pushed the other way round
+			if (joined3 && tail->command == pc_swap && out.at[n - 3].command == pc_push_value && out.at[n - 2].command == pc_push_value)
+			{
+				std::swap(out.at[n - 3].constant, out.at[n - 2].constant);
+				out.length = n - 1;
+				changed = true;
+				continue;
+			}
+
+			// && and ||
+			if (joined3 && tail->command == pc_pop && out.at[n - 3].command == pc_dup
+				&& (out.at[n - 2].command == pc_case_if_not || out.at[n - 2].command == pc_case_if))
+			{
+				command_kind command = (out.at[n - 2].command == pc_case_if_not) ? pc_and_then : pc_or_else;
+				out.at[n - 3] = code(command, out.at[n - 2].ip);
+				out.length = n - 2;
+				changed = true;
+				continue;
+			}
+
+			// a comparison with its result
+			if (joined2 && tail->command >= pc_compare_e && tail->command <= pc_compare_ne && out.at[n - 2].command == pc_compare)
+			{
+				code & fused = out.at[n - 2];
+				command_kind operation = tail->command;
+				fused.command = pc_comparison;
+				fused.cached_shape = NULL;
+				fused.cached_slot = 0;
+				fused.operation = operation;
+				out.length = n - 1;
+				changed = true;
+				continue;
+			}
+
+			// return with a value
+			if (joined2 && tail->command == pc_break_routine && out.at[n - 2].command == pc_assign)
+			{
+				out.at[n - 2].command = pc_return;
+				out.length = n - 1;
+				changed = true;
+				continue;
+			}
+		}
+		landing.resize(out.length);
+		lines.length = out.length;
+	}
+
+	// Destinations move with their codes
+	for (unsigned i = 0; i < out.length; ++i)
+	{
+		code & c = out.at[i];
+		if (code_jumps(c.command))
+			c.ip = map[c.ip];
+		else if ((c.command == pc_call || c.command == pc_call_and_push_result) && c.sub->kind == bk_loop)
+			c.sub->break_ip = map[c.sub->break_ip];
+	}
+
+	b->codes = std::move(out);
+	b->lines = std::move(lines);
+}
 
-			if (removing->has_result)
-			{
-				assert(current != NULL && removing->variables.length > 0);
-				current->stack.push_back(removing->variables.at[0]);
-			}
-			else if (removing->sub->kind == script_engine::bk_microthread)
-			{
-				threads.erase(threads.begin() + current_thread_index);
-				yield();
-			}
+void script_machine::advance()
+{
+	// Runs the current thread until it yields, launches or finishes a microthread, or the machine finishes.
+	// Dispatch uses a table of label addresses where available and a switch otherwise.
+#if defined(__SCRIPT_H__COUNT_CODES)
+#define COUNT_CODE() (++code_count)
+#else
+#define COUNT_CODE() ((void)0)
+#endif
 
-			assert(removing->stack.length == 0);
+#ifdef __SCRIPT_H__THREADED_DISPATCH
+	static void * const dispatch_table[] =
+	{
+		&&label_pc_assign, &&label_pc_assign_writable, &&label_pc_break_loop, &&label_pc_break_routine, &&label_pc_call,
+		&&label_pc_call_and_push_result, &&label_pc_case_begin, &&label_pc_case_end, &&label_pc_case_if,
+		&&label_pc_case_if_not, &&label_pc_case_next, &&label_pc_compare_e, &&label_pc_compare_g, &&label_pc_compare_ge,
+		&&label_pc_compare_l, &&label_pc_compare_le, &&label_pc_compare_ne, &&label_pc_dup, &&label_pc_dup2,
+		&&label_pc_loop_ascent, &&label_pc_loop_back, &&label_pc_loop_count, &&label_pc_loop_descent, &&label_pc_loop_if,
+		&&label_pc_pop, &&label_pc_push_value, &&label_pc_push_variable, &&label_pc_push_variable_writable, &&label_pc_swap,
+		&&label_pc_yield, &&label_pc_exit, &&label_pc_add, &&label_pc_subtract, &&label_pc_multiply, &&label_pc_divide,
+		&&label_pc_remainder, &&label_pc_power, &&label_pc_compare, &&label_pc_negative, &&label_pc_successor,
+		&&label_pc_predecessor, &&label_pc_concatenate, &&label_pc_get_property, &&label_pc_set_property,
+		&&label_pc_concatenate_assign, &&label_pc_modify_element, &&label_pc_modify_property, &&label_pc_range_ascent,
+		&&label_pc_range_descent, &&label_pc_range_ascent_back, &&label_pc_range_descent_back, &&label_pc_loop_count_back,
+		&&label_pc_declare, &&label_pc_clear_variables, &&label_pc_and_then, &&label_pc_or_else, &&label_pc_comparison,
+		&&label_pc_return
+	};
+	static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == script_engine::pc_return + 1,
+		"dispatch_table must list every command_kind in order");
+
+#define DISPATCH_CASE(command) label_##command:
+#define DISPATCH_NEXT() \
+	do { \
+		if (pc >= codes_end) goto end_of_block; \
+		c = pc++; \
+		COUNT_CODE(); \
+		goto *dispatch_table[c->command]; \
+	} while (0)
+#else
+#define DISPATCH_CASE(command) case script_engine::command:
+#define DISPATCH_NEXT() continue
+#endif
 
-			for (;;)
-			{
-				--(removing->ref_count);
-				if (removing->ref_count > 0)
-					break;
-				environment * next = removing->parent;
-				dispose_environment(removing);
-				removing = next;
-			}
-		}
+	// The position in the codes is kept in pc while running and written back to the environment
+	// whenever something else may read it: native calls, errors, breaks and thread changes.
+#define SAVE_IP() (current->ip = static_cast < unsigned > (pc - codes))
+#define LOAD_IP() (pc = codes + current->ip)
+
+	// Built-in operators compute reals inline and call the native function for every other type
+#define BINARY_OPERATION(command, expression) \
+	{ \
+		stack_t * stack = &current->stack; \
+		assert(stack->length >= 2); \
+		value * left = &stack->at[stack->length - 2]; \
+		value * right = &stack->at[stack->length - 1]; \
+		long long r; \
+		if (left->is_integer() && right->is_integer() \
+			&& integer_operation(script_engine::command, left->get_integer(), right->get_integer(), r)) \
+		{ \
+			left->set_number(r); \
+			stack->pop_back(); \
+		} \
+		else if (left->get_type() == real_type && right->get_type() == real_type) \
+		{ \
+			real_t a = left->get_real(); \
+			real_t b = right->get_real(); \
+			left->set(real_type, static_cast < real_t > (expression)); \
+			stack->pop_back(); \
+		} \
+		else \
+		{ \
+			SAVE_IP(); \
+			*left = c->sub->func(this, 2, left); \
+			stack->pop_back(); \
+			if (finished) \
+				return; \
+		} \
+	} \
+	DISPATCH_NEXT()
+
+#define UNARY_OPERATION(command, expression) \
+	{ \
+		stack_t * stack = &current->stack; \
+		assert(stack->length >= 1); \
+		value * operand = &stack->at[stack->length - 1]; \
+		long long r; \
+		if (operand->is_integer() && integer_operation(script_engine::command, operand->get_integer(), 0, r)) \
+			operand->set_number(r); \
+		else if (operand->get_type() == real_type) \
+		{ \
+			real_t a = operand->get_real(); \
+			operand->set(real_type, static_cast < real_t > (expression)); \
+		} \
+		else \
+		{ \
+			SAVE_IP(); \
+			*operand = c->sub->func(this, 1, operand); \
+			if (finished) \
+				return; \
+		} \
+	} \
+	DISPATCH_NEXT()
+
+	// Moves the top of the stack into the variable of the code
+#define ASSIGN_VARIABLE() \
+	{ \
+		stack_t * stack = &current->stack; \
+		assert(stack->length > 0); \
+		assert(static_cast < unsigned > (c->level) < current->display.length); \
+		variables_t * vars = &current->display.at[c->level]->variables; \
+		if (vars->length <= c->variable) \
+		{ \
+			while (vars->capacity <= c->variable) vars->expand(); \
+			vars->length = c->variable + 1; \
+		} \
+		value * dest = &(vars->at[c->variable]); \
+		value * src = &stack->at[stack->length - 1]; \
+		if (!assignable(*dest, *src)) \
+		{ \
+			SAVE_IP(); \
+			raise_error("Type mismatch on variable assignment."); \
+		} \
+		*dest = std::move(*src); \
+		stack->pop_back(); \
+		if (finished) \
+			return; \
 	}
-	else
+
+	// Turns the result of compare into a boolean
+#define COMPARISON(expression) \
+	{ \
+		value & t = current->stack.at[current->stack.length - 1]; \
+		real_t r = t.as_real(); \
+		t.set(boolean_type, static_cast < bool > (expression)); \
+	} \
+	DISPATCH_NEXT()
+
+	assert(current_thread != NULL);
+	environment * current;
+	script_engine::code * codes;
+	script_engine::code * codes_end;
+	script_engine::code * pc;
+	script_engine::code * c;
+	type_data * const real_type = engine->get_real_type();
+	type_data * const boolean_type = engine->get_boolean_type();
+	value const * const constants = engine->constants.at;
+
+reload:
+	current = current_thread->current;
+	codes = current->sub->codes.at;
+	codes_end = codes + current->sub->codes.length;
+	LOAD_IP();
+
+	for (;;)
 	{
-		script_engine::code * c = &(current->sub->codes.at[current->ip]);
-		error_line = c->line;	//
-		++(current->ip);
+		if (pc >= codes_end)
+			goto end_of_block;
 
+		c = pc++;
+		COUNT_CODE();
+
+#ifdef __SCRIPT_H__THREADED_DISPATCH
+		goto *dispatch_table[c->command];
+#else
 		switch (c->command)
+#endif
 		{
-		case script_engine::pc_assign:
+		DISPATCH_CASE(pc_assign)
+			ASSIGN_VARIABLE();
+			DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_declare)
 		{
 			stack_t * stack = &current->stack;
 			assert(stack->length > 0);
-			for (environment * i = current; i != NULL; i = i->parent)
+			assert(static_cast < unsigned > (c->level) < current->display.length);
+			variables_t * vars = &current->display.at[c->level]->variables;
+			if (vars->length <= c->variable)
 			{
-				if (i->sub->level == c->level)
-				{
-					variables_t * vars = &i->variables;
-					if (vars->length <= c->variable)
-					{
-						while (vars->capacity <= c->variable) vars->expand();
-						vars->length = c->variable + 1;
-					}
-					value * dest = &(vars->at[c->variable]);
-					value * src = &stack->at[stack->length - 1];
-
-					if (dest->has_data() && dest->get_type() != src->get_type()
-						&& !(dest->get_type()->get_kind() == type_data::tk_array
-							&& src->get_type()->get_kind() == type_data::tk_array
-							&& (dest->length_as_array() == 0 || src->length_as_array() == 0)
-							&& dest->get_type()->get_element()->get_kind() != type_data::tk_char
-							&& src->get_type()->get_element()->get_kind() == type_data::tk_char))
-						raise_error("Type mismatch on variable assignment.");
-					*dest = *src;
-					stack->pop_back();
-					break;
-				}
+				while (vars->capacity <= c->variable) vars->expand();
+				vars->length = c->variable + 1;
 			}
+			vars->at[c->variable] = std::move(stack->at[stack->length - 1]);
+			stack->pop_back();
 		}
-		break;
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_clear_variables)
+		{
+			variables_t * vars = &current->variables;
+			unsigned end = c->first_variable + c->variable_count;
+			if (end > vars->length)
+				end = vars->length;
+			for (unsigned i = c->first_variable; i < end; ++i)
+				vars->at[i] = value();
+		}
+		DISPATCH_NEXT();
 
-		case script_engine::pc_assign_writable:
+		DISPATCH_CASE(pc_assign_writable)
 		{
+			// Stack holds the array, the index and the new element
 			stack_t * stack = &current->stack;
-			assert(stack->length >= 2);
-			value * dest = &stack->at[stack->length - 2];
+			assert(stack->length >= 3);
+			value * container = &stack->at[stack->length - 3];
+			long long index;
+			bool whole = get_index(stack->at[stack->length - 2], index);
 			value * src = &stack->at[stack->length - 1];
-			if (dest->has_data() && dest->get_type() != src->get_type()
-				&& !(dest->get_type()->get_kind() == type_data::tk_array 
-					&& src->get_type()->get_kind() == type_data::tk_array
-					&& (dest->length_as_array() == 0 || src->length_as_array() == 0)
-					&& dest->get_type()->get_element()->get_kind() != type_data::tk_char
-					&& src->get_type()->get_element()->get_kind() == type_data::tk_char))
-				raise_error("Type mismatch on variable assignment.");
+
+			SAVE_IP();
+			if (container->get_type()->get_kind() != type_data::tk_array)
+				raise_error("Attempted to write to an index of a non-array value.");
+			else if (!whole)
+				raise_error("Array index contains a decimal point.");
+			else if (index < 0 || index >= container->length_as_array())
+				raise_error("Array index is out of bounds.");
 			else
 			{
-				dest->overwrite(*src);
-				stack->length -= 2;
+				value const & dest = container->index_as_array(index);
+				if (!assignable(dest, *src))
+					raise_error("Type mismatch on variable assignment.");
+				else
+				{
+					container->assign_as_array(index, *src);
+					// Drop the reference to the array so the next write does not copy it
+					*container = value();
+					stack->length -= 3;
+				}
 			}
+			if (finished)
+				return;
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_break_loop:
-		case script_engine::pc_break_routine:
+		DISPATCH_CASE(pc_return)
+			ASSIGN_VARIABLE();
+			if (current->frame && current->sub->kind == script_engine::bk_function && current->ref_count == 1)
+			{
+				// A function on a frame returns straight to its caller, nothing else can see the frame
+				environment * removing = current;
+				current = removing->parent;
+				assert(current != NULL && current->ref_count > 1);
+				current_thread->current = current;
+				removing->stack.clear();
+				if (removing->has_result)
+					current->stack.push_back(std::move(removing->variables.at[0]));
+				removing->ref_count = 0;
+				dispose_frame(removing);
+				--(current->ref_count);
+				goto reload;
+			}
+			//fall through to leave the routine
+		DISPATCH_CASE(pc_break_loop)
+		DISPATCH_CASE(pc_break_routine)
+			SAVE_IP();
 			for (environment * i = current; i != NULL; i = i->parent)
 			{
 				i->ip = i->sub->codes.length;
@@ -2685,25 +4555,24 @@ void script_machine::advance()
 					{
 						environment * e = i->parent;
 						assert(e != NULL);
-						do
-							++(e->ip);
-						while (e->sub->codes.at[e->ip - 1].command != script_engine::pc_loop_back);
+						e->ip = i->sub->break_ip;
 						break;
 					}
 				}
 				else
 				{
+					// Whatever the environments left hold is the state of loops, including loops inlined into them
+					i->stack.clear();
 					if (i->sub->kind == script_engine::bk_sub || i->sub->kind == script_engine::bk_function
 						|| i->sub->kind == script_engine::bk_microthread)
 						break;
-					else if (i->sub->kind == script_engine::bk_loop)
-						i->parent->stack.clear(); /*kludge also a good place*/ /*׍HƂ*/
 				}
 			}
-			break;
+			LOAD_IP();
+			DISPATCH_NEXT();
 
-		case script_engine::pc_call:
-		case script_engine::pc_call_and_push_result:
+		DISPATCH_CASE(pc_call)
+		DISPATCH_CASE(pc_call_and_push_result)
 		{
 			stack_t * current_stack = &current->stack;
 			assert(current_stack->length >= c->arguments);
@@ -2711,8 +4580,8 @@ void script_machine::advance()
 			{
 				//native calls //lCeBuĂяo  
 				value * argv = &((*current_stack).at[current_stack->length - c->arguments]);
-				value ret;
-				ret = c->sub->func(this, c->arguments, argv);
+				SAVE_IP();
+				value ret = c->sub->func(this, c->arguments, argv);
 				if (stopped)
 				{
 					--(current->ip);
@@ -2725,48 +4594,343 @@ void script_machine::advance()
 					current_stack->length -= c->arguments;
 					//return value //߂l 
 					if (c->command == script_engine::pc_call_and_push_result)
-						current_stack->push_back(ret);
+						current_stack->push_back(std::move(ret));
+				}
+				if (finished)
+					return;
+				if (sleep_frames != 0)
+				{
+					//wakes in the frame it would reach after as many yields, the last frame if that is past the counter
+					thread * sleeping = current_thread;
+					unsigned long long const last_frame = std::numeric_limits < unsigned long long >::max();
+					sleeping->wake_frame = (sleep_frames > last_frame - frame_count) ? last_frame : frame_count + sleep_frames;
+					sleep_frames = 0;
+					yield();
+					park_thread(sleeping);
+					return;
 				}
+				DISPATCH_NEXT();
 			}
 			else if (c->sub->kind == script_engine::bk_microthread)
 			{
+				SAVE_IP();
 				//launch microthread //}CNXbhN
 				++(current->ref_count);
 				environment * e = new_environment(current, c->sub);
-				++current_thread_index;
-				threads.insert(threads.begin() + current_thread_index, e);
+				current_thread = new_thread(current_thread, e);
 				//transhipment of the argument //̐ςݑւ
 				for (unsigned i = 0; i < c->arguments; ++i)
 				{
-					e->stack.push_back(current_stack->at[current_stack->length - 1]);
+					e->stack.push_back(std::move(current_stack->at[current_stack->length - 1]));
 					current_stack->pop_back();
 				}
+				return;
 			}
 			else
 			{
+				if (c->sub->frame)
+				{
+					// The arguments go straight into the variables the first codes of the block assign them to
+					SAVE_IP();
+					++(current->ref_count);
+					environment * e = new_frame(current, c->sub);
+					e->has_result = c->command == script_engine::pc_call_and_push_result;
+					current_thread->current = e;
+					value * argv = &current_stack->at[current_stack->length - c->arguments];
+					variables_t * vars = &e->variables;
+					for (unsigned i = 0; i < c->arguments; ++i)
+					{
+						unsigned variable = c->sub->codes.at[i].variable;
+						if (vars->length <= variable)
+						{
+							while (vars->capacity <= variable) vars->expand();
+							vars->length = variable + 1;
+						}
+						vars->at[variable] = std::move(argv[i]);
+					}
+					current_stack->length -= c->arguments;
+					e->ip = c->arguments;
+					goto reload;
+				}
+
 				//between script invocations //XNvgԂ̌Ăяo
 
+				SAVE_IP();
 				++(current->ref_count);
 				environment * e = new_environment(current, c->sub);
 				e->has_result = c->command == script_engine::pc_call_and_push_result;
-				threads[current_thread_index] = e;
+				current_thread->current = e;
 				//transshipment of the argument //̐ςݑւ  
 				for (unsigned i = 0; i < c->arguments; ++i)
 				{
-					e->stack.push_back(current_stack->at[current_stack->length - 1]);
+					e->stack.push_back(std::move(current_stack->at[current_stack->length - 1]));
 					current_stack->pop_back();
 				}
+				goto reload;
 			}
 		}
-		break;
 
-		case script_engine::pc_case_begin:
-		case script_engine::pc_case_end:
-			break;
+		DISPATCH_CASE(pc_add)
+			BINARY_OPERATION(pc_add, a + b);
 
-		case script_engine::pc_case_if:
-		case script_engine::pc_case_if_not:
-		case script_engine::pc_case_next:
+		DISPATCH_CASE(pc_subtract)
+			BINARY_OPERATION(pc_subtract, a - b);
+
+		DISPATCH_CASE(pc_multiply)
+			BINARY_OPERATION(pc_multiply, a * b);
+
+		DISPATCH_CASE(pc_divide)
+			BINARY_OPERATION(pc_divide, a / b);
+
+		DISPATCH_CASE(pc_remainder)
+			BINARY_OPERATION(pc_remainder, std::fmod(a, b));
+
+		DISPATCH_CASE(pc_power)
+			BINARY_OPERATION(pc_power, std::pow(a, b));
+
+		DISPATCH_CASE(pc_compare)
+			BINARY_OPERATION(pc_compare, (a == b) ? 0 : (a < b) ? -1 : 1);
+
+		DISPATCH_CASE(pc_negative)
+			UNARY_OPERATION(pc_negative, -a);
+
+		DISPATCH_CASE(pc_successor)
+			UNARY_OPERATION(pc_successor, a + 1);
+
+		DISPATCH_CASE(pc_predecessor)
+			UNARY_OPERATION(pc_predecessor, a - 1);
+
+		DISPATCH_CASE(pc_concatenate)
+		{
+			// An array held only by the stack grows in place, so chains of ~ do not copy every step
+			stack_t * stack = &current->stack;
+			assert(stack->length >= 2);
+			value * left = &stack->at[stack->length - 2];
+			value * right = &stack->at[stack->length - 1];
+			if (left->has_data() && left->get_type() == right->get_type()
+				&& left->get_type()->get_kind() == type_data::tk_array)
+			{
+				left->concatenate(*right);
+				stack->pop_back();
+			}
+			else
+			{
+				SAVE_IP();
+				*left = c->sub->func(this, 2, left);
+				stack->pop_back();
+				if (finished)
+					return;
+			}
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_concatenate_assign)
+		{
+			// Appends into the array of the variable, which is only copied while something else shares it
+			stack_t * stack = &current->stack;
+			assert(stack->length > 0);
+			assert(static_cast < unsigned > (c->level) < current->display.length);
+			variables_t * vars = &current->display.at[c->level]->variables;
+			if (vars->length <= c->variable || !((*vars).at[c->variable].has_data()))
+			{
+				SAVE_IP();
+				raise_error("Attempted to use a variable that has not been initialized.");
+				return;
+			}
+			value * dest = &vars->at[c->variable];
+			value * src = &stack->at[stack->length - 1];
+			if (dest->get_type() == src->get_type() && dest->get_type()->get_kind() == type_data::tk_array)
+				dest->concatenate(*src);
+			else
+			{
+				// Anything else goes the way of x = x ~ y
+				SAVE_IP();
+				value argv[2] = { *dest, *src };
+				value result = concatenate(this, 2, argv);
+				if (!finished)
+				{
+					if (!assignable(*dest, result))
+						raise_error("Type mismatch on variable assignment.");
+					else
+						*dest = std::move(result);
+				}
+			}
+			stack->pop_back();
+			if (finished)
+				return;
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_modify_element)
+		{
+			// Stack holds the array and the index, then for binary operators the old element and the operand
+			// ++ and -- read the element in the body shared with the variable, packed storage is kept
+			stack_t * stack = &current->stack;
+			unsigned operands = (c->operation == script_engine::pc_successor || c->operation == script_engine::pc_predecessor) ? 0 : 2;
+			assert(stack->length >= 2 + operands);
+			value * container = &stack->at[stack->length - 2 - operands];
+			long long index;
+			bool whole = get_index(stack->at[stack->length - 1 - operands], index);
+			value * operand = &stack->at[stack->length - 1];
+
+			SAVE_IP();
+			if (container->get_type()->get_kind() != type_data::tk_array)
+				raise_error("Attempted to write to an index of a non-array value.");
+			else if (!whole)
+				raise_error("Array index contains a decimal point.");
+			else if (index < 0 || index >= container->length_as_array())
+				raise_error("Array index is out of bounds.");
+			else
+			{
+				value element = (operands == 0) ? container->index_as_array(index) : std::move(stack->at[stack->length - 2]);
+				long long r;
+				if (element.is_integer() && (operands == 0 || operand->is_integer())
+					&& integer_operation(c->operation, element.get_integer(), (operands == 0) ? 0 : operand->get_integer(), r))
+					container->assign_as_array(index, value(real_type, r));
+				else if (element.get_type() == real_type && (operands == 0 || operand->get_type() == real_type))
+				{
+					real_t b = (operands == 0) ? 0 : operand->get_real();
+					container->assign_as_array(index, value(real_type, real_operation(c->operation, element.get_real(), b)));
+				}
+				else if (c->operation == script_engine::pc_concatenate && element.get_type() == operand->get_type()
+					&& element.get_type()->get_kind() == type_data::tk_array)
+				{
+					// Appends into the old element, which is only copied while something else shares it
+					container->index_as_array_writable(index) = value();
+					element.concatenate(*operand);
+					container->assign_as_array(index, element);
+				}
+				else
+				{
+					value argv[2] = { element, *operand };
+					value result = operation_function(c->operation)(this, (operands == 0) ? 1 : 2, argv);
+					if (finished)
+						return;
+					if (!assignable(container->index_as_array(index), result))
+						raise_error("Type mismatch on variable assignment.");
+					else
+						container->assign_as_array(index, result);
+				}
+			}
+			if (finished)
+				return;
+			// Drop the reference to the array so the next write does not copy it
+			*container = value();
+			stack->length -= 2 + operands;
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_modify_property)
+		{
+			// Stack holds the object, then for binary operators the old value of the property and the operand
+			stack_t * stack = &current->stack;
+			unsigned operands = (c->operation == script_engine::pc_successor || c->operation == script_engine::pc_predecessor) ? 0 : 2;
+			assert(stack->length >= 1 + operands);
+			value * object = &stack->at[stack->length - 1 - operands];
+			value * operand = &stack->at[stack->length - 1];
+			shape * s = object->get_shape();
+			if (s == NULL || s != c->cached_shape)
+			{
+				int slot = (s != NULL) ? s->find(c->atom) : -1;
+				if (slot < 0)
+				{
+					SAVE_IP();
+					raise_error((s == NULL) ? "Cannot access property from non-object value." : "Property not found.");
+					return;
+				}
+				c->cached_shape = s;
+				c->cached_slot = slot;
+			}
+			value const & element = (operands == 0) ? object->get_slot(c->cached_slot) : stack->at[stack->length - 2];
+			long long r;
+			if (element.is_integer() && (operands == 0 || operand->is_integer())
+				&& integer_operation(c->operation, element.get_integer(), (operands == 0) ? 0 : operand->get_integer(), r))
+				object->set_slot(c->cached_slot, value(real_type, r));
+			else if (element.get_type() == real_type && (operands == 0 || operand->get_type() == real_type))
+			{
+				real_t b = (operands == 0) ? 0 : operand->get_real();
+				object->set_slot(c->cached_slot, value(real_type, real_operation(c->operation, element.get_real(), b)));
+			}
+			else
+			{
+				SAVE_IP();
+				value argv[2] = { element, *operand };
+				value result = operation_function(c->operation)(this, (operands == 0) ? 1 : 2, argv);
+				if (finished)
+					return;
+				if (!result.has_data() || object->get_slot(c->cached_slot).get_type() != result.get_type())
+				{
+					raise_error("Type mismatch on property assignment.");
+					return;
+				}
+				object->set_slot(c->cached_slot, result);
+			}
+			stack->length -= 1 + operands;
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_get_property)
+		{
+			// Stack holds the object, which is replaced by the property
+			stack_t * stack = &current->stack;
+			assert(stack->length >= 1);
+			value * object = &stack->at[stack->length - 1];
+			shape * s = object->get_shape();
+			if (s == NULL || s != c->cached_shape)
+			{
+				int slot = (s != NULL) ? s->find(c->atom) : -1;
+				if (slot < 0)
+				{
+					SAVE_IP();
+					raise_error((s == NULL) ? "Cannot access property from non-object value." : "Property not found.");
+					return;
+				}
+				c->cached_shape = s;
+				c->cached_slot = slot;
+			}
+			value result = object->get_slot(c->cached_slot);
+			*object = std::move(result);
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_set_property)
+		{
+			// Stack holds the object and the new value
+			stack_t * stack = &current->stack;
+			assert(stack->length >= 2);
+			value * object = &stack->at[stack->length - 2];
+			value * src = &stack->at[stack->length - 1];
+			shape * s = object->get_shape();
+			if (s == NULL || s != c->cached_shape)
+			{
+				int slot = (s != NULL) ? s->find(c->atom) : -1;
+				if (slot < 0)
+				{
+					SAVE_IP();
+					raise_error((s == NULL) ? "Cannot set property for non-object value." : "Property not found.");
+					return;
+				}
+				c->cached_shape = s;
+				c->cached_slot = slot;
+			}
+			if (!src->has_data() || object->get_slot(c->cached_slot).get_type() != src->get_type())
+			{
+				SAVE_IP();
+				raise_error("Type mismatch on property assignment.");
+				return;
+			}
+			object->set_slot(c->cached_slot, *src);
+			stack->length -= 2;
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_case_begin)
+		DISPATCH_CASE(pc_case_end)
+			DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_case_if)
+		DISPATCH_CASE(pc_case_if_not)
+		DISPATCH_CASE(pc_case_next)
 		{
 			bool exit = true;
 			if (c->command != script_engine::pc_case_next)
@@ -2778,83 +4942,83 @@ void script_machine::advance()
 				current_stack->pop_back();
 			}
 			if (exit)
-			{
-				int nested = 0;
-				for (; ; )
-				{
-					switch (current->sub->codes.at[current->ip].command)
-					{
-					case script_engine::pc_case_begin:
-						++nested;
-						break;
-					case script_engine::pc_case_end:
-						--nested;
-						if (nested < 0)
-							goto next;
-						break;
-					case script_engine::pc_case_next:
-						if (nested == 0 && c->command != script_engine::pc_case_next)
-						{
-							++(current->ip);
-							goto next;
-						}
-						break;
-					}
-					++(current->ip);
-				}
-			next:
-#ifdef _MSC_VER
-				;
-#endif
-			}
+				pc = codes + c->ip;
 		}
-		break;
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_compare_e)
+			COMPARISON(r == 0);
 
-		case script_engine::pc_compare_e:
-		case script_engine::pc_compare_g:
-		case script_engine::pc_compare_ge:
-		case script_engine::pc_compare_l:
-		case script_engine::pc_compare_le:
-		case script_engine::pc_compare_ne:
+		DISPATCH_CASE(pc_compare_g)
+			COMPARISON(r > 0);
+
+		DISPATCH_CASE(pc_compare_ge)
+			COMPARISON(r >= 0);
+
+		DISPATCH_CASE(pc_compare_l)
+			COMPARISON(r < 0);
+
+		DISPATCH_CASE(pc_compare_le)
+			COMPARISON(r <= 0);
+
+		DISPATCH_CASE(pc_compare_ne)
+			COMPARISON(r != 0);
+
+		DISPATCH_CASE(pc_and_then)
+		DISPATCH_CASE(pc_or_else)
+		{
+			// The left operand is the value when it decides, otherwise it gives way to the right one
+			stack_t * stack = &current->stack;
+			assert(stack->length > 0);
+			if (stack->at[stack->length - 1].as_boolean() == (c->command == script_engine::pc_or_else))
+				pc = codes + c->ip;
+			else
+				stack->pop_back();
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_comparison)
 		{
 			stack_t * stack = &current->stack;
-			value & t = stack->at[stack->length - 1];
-			long double r = t.as_real();
+			assert(stack->length >= 2);
+			value * left = &stack->at[stack->length - 2];
+			value * right = &stack->at[stack->length - 1];
+			int r;
+			if (left->is_integer() && right->is_integer())
+				r = (left->get_integer() == right->get_integer()) ? 0 : (left->get_integer() < right->get_integer()) ? -1 : 1;
+			else if (left->get_type() == real_type && right->get_type() == real_type)
+				r = (left->get_real() == right->get_real()) ? 0 : (left->get_real() < right->get_real()) ? -1 : 1;
+			else
+			{
+				SAVE_IP();
+				r = static_cast < int > (compare(this, 2, left).as_real());
+				if (finished)
+					return;
+			}
 			bool b;
-			switch (c->command)
+			switch (c->operation)
 			{
-			case script_engine::pc_compare_e:
-				b = r == 0;
-				break;
-			case script_engine::pc_compare_g:
-				b = r > 0;
-				break;
-			case script_engine::pc_compare_ge:
-				b = r >= 0;
-				break;
-			case script_engine::pc_compare_l:
-				b = r < 0;
-				break;
-			case script_engine::pc_compare_le:
-				b = r <= 0;
-				break;
-			case script_engine::pc_compare_ne:
-				b = r != 0;
-				break;
+			case script_engine::pc_compare_e: b = r == 0; break;
+			case script_engine::pc_compare_g: b = r > 0; break;
+			case script_engine::pc_compare_ge: b = r >= 0; break;
+			case script_engine::pc_compare_l: b = r < 0; break;
+			case script_engine::pc_compare_le: b = r <= 0; break;
+			default: b = r != 0; break;
 			}
-			t.set(engine->get_boolean_type(), b);
+			left->set(boolean_type, b);
+			stack->pop_back();
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_dup:
+		DISPATCH_CASE(pc_dup)
 		{
 			stack_t * stack = &current->stack;
 			assert(stack->length > 0);
 			stack->push_back(stack->at[stack->length - 1]);
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_dup2:
+		DISPATCH_CASE(pc_dup2)
 		{
 			stack_t * stack = &current->stack;
 			int len = stack->length;
@@ -2862,121 +5026,217 @@ void script_machine::advance()
 			stack->push_back(stack->at[len - 2]);
 			stack->push_back(stack->at[len - 1]);
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_loop_back:
-			current->ip = c->ip;
-			break;
+		DISPATCH_CASE(pc_loop_back)
+			pc = codes + c->ip;
+			DISPATCH_NEXT();
 
-		case script_engine::pc_loop_ascent:
+		DISPATCH_CASE(pc_loop_ascent)
 		{
 			stack_t * stack = &current->stack;
 			value * i = &stack->at[stack->length - 1];
 			if (i->as_real() <= 0)
-			{
-				do
-					++(current->ip);
-				while (current->sub->codes.at[current->ip - 1].command != script_engine::pc_loop_back);
-			}
+				pc = codes + c->ip;
 			current->stack.pop_back();
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_loop_descent:
+		DISPATCH_CASE(pc_loop_descent)
 		{
 			stack_t * stack = &current->stack;
 			value * i = &stack->at[stack->length - 1];
 			if (i->as_real() >= 0)
+				pc = codes + c->ip;
+			current->stack.pop_back();
+		}
+		DISPATCH_NEXT();
+
+		DISPATCH_CASE(pc_range_ascent)
+		DISPATCH_CASE(pc_range_descent)
+		DISPATCH_CASE(pc_range_ascent_back)
+		DISPATCH_CASE(pc_range_descent_back)
+		{
+			// Going up the counter steps after the body, in the back code, going down it steps before
+			// Each turn of the body gets a copy of the counter
+			stack_t * stack = &current->stack;
+			assert(stack->length >= 2);
+			bool ascent = c->command == script_engine::pc_range_ascent || c->command == script_engine::pc_range_ascent_back;
+			bool back = c->command == script_engine::pc_range_ascent_back || c->command == script_engine::pc_range_descent_back;
+			SAVE_IP();
+			if (ascent && back)
+				step_range(this, &stack->at[stack->length - 1], true);
+			bool going = !finished && in_range(this, &stack->at[stack->length - 2], ascent);
+			if (going && !ascent)
+				step_range(this, &stack->at[stack->length - 1], false);
+			if (finished)
+				return;
+
+			if (going)
 			{
-				do
-					++(current->ip);
-				while (current->sub->codes.at[current->ip - 1].command != script_engine::pc_loop_back);
+				stack->push_back(stack->at[stack->length - 1]);
+				if (back)
+					pc = codes + c->ip + 1;
 			}
-			current->stack.pop_back();
+			else if (!back)
+				pc = codes + c->ip;
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_loop_count:
+		DISPATCH_CASE(pc_loop_count)
+		DISPATCH_CASE(pc_loop_count_back)
 		{
+			// The header leaves the loop when the count runs out, the back code goes on to the body while it does not
 			stack_t * stack = &current->stack;
 			value * i = &stack->at[stack->length - 1];
 			assert(i->get_type()->get_kind() == type_data::tk_real);
-			long double r = i->as_real();
-			if (r > 0)
-				i->set(engine->get_real_type(), r - 1);
+			bool going;
+			if (i->is_integer())
+			{
+				long long n = i->get_integer();
+				going = n > 0;
+				if (going)
+					i->set(real_type, n - 1);
+			}
 			else
 			{
-				do
-					++(current->ip);
-				while (current->sub->codes.at[current->ip - 1].command != script_engine::pc_loop_back);
+				real_t r = i->as_real();
+				going = r > 0;
+				if (going)
+					i->set(real_type, r - 1);
+			}
+			if (c->command == script_engine::pc_loop_count_back)
+			{
+				if (going)
+					pc = codes + c->ip + 1;
 			}
+			else if (!going)
+				pc = codes + c->ip;
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_loop_if:
+		DISPATCH_CASE(pc_loop_if)
 		{
 			stack_t * stack = &current->stack;
-			bool c = stack->at[stack->length - 1].as_boolean();
+			bool b = stack->at[stack->length - 1].as_boolean();
 			current->stack.pop_back();
-			if (!c)
-			{
-				do
-					++(current->ip);
-				while (current->sub->codes.at[current->ip - 1].command != script_engine::pc_loop_back);
-			}
+			if (!b)
+				pc = codes + c->ip;
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_pop:
+		DISPATCH_CASE(pc_pop)
 			assert(current->stack.length > 0);
 			current->stack.pop_back();
-			break;
+			DISPATCH_NEXT();
 
-		case script_engine::pc_push_value:
-			current->stack.push_back(c->data);
-			break;
+		DISPATCH_CASE(pc_push_value)
+			current->stack.push_back(constants[c->constant]);
+			DISPATCH_NEXT();
 
-		case script_engine::pc_push_variable:
-		case script_engine::pc_push_variable_writable:
-			for (environment * i = current; i != NULL; i = i->parent)
+		DISPATCH_CASE(pc_push_variable)
+		DISPATCH_CASE(pc_push_variable_writable)
+		{
+			assert(static_cast < unsigned > (c->level) < current->display.length);
+			variables_t * vars = &current->display.at[c->level]->variables;
+			if (vars->length <= c->variable || !((*vars).at[c->variable].has_data()))
 			{
-				if (i->sub->level == c->level)
-				{
-					variables_t * vars = &i->variables;
-					if (vars->length <= c->variable || !((*vars).at[c->variable].has_data()))
-						raise_error("Attempted to use a variable that has not been initialized.");
-					else
-					{
-						value * var = &(*vars).at[c->variable];
-						if (c->command == script_engine::pc_push_variable_writable)
-							var->unique();
-						current->stack.push_back(*var);
-					}
-					break;
-				}
+				SAVE_IP();
+				raise_error("Attempted to use a variable that has not been initialized.");
+				return;
 			}
-			break;
+			value * var = &(*vars).at[c->variable];
+			if (c->command == script_engine::pc_push_variable_writable)
+				var->unique();
+			current->stack.push_back(*var);
+		}
+		DISPATCH_NEXT();
 
-		case script_engine::pc_swap:
+		DISPATCH_CASE(pc_swap)
 		{
 			int len = current->stack.length;
 			assert(len >= 2);
-			value t = current->stack[len - 1];
-			current->stack[len - 1] = current->stack[len - 2];
-			current->stack[len - 2] = t;
+			value t = std::move(current->stack[len - 1]);
+			current->stack[len - 1] = std::move(current->stack[len - 2]);
+			current->stack[len - 2] = std::move(t);
 		}
-		break;
+		DISPATCH_NEXT();
 
-		case script_engine::pc_yield:
+		DISPATCH_CASE(pc_yield)
+			SAVE_IP();
 			yield();
-			break;
+			return;
 
-		case script_engine::pc_exit:
+		DISPATCH_CASE(pc_exit)
+			SAVE_IP();
 			stop();
-			break;
+			return;
 
+#ifndef __SCRIPT_H__THREADED_DISPATCH
 		default:
 			assert(false);
+#endif
+		}
+	}
+
+end_of_block:
+	{
+		SAVE_IP();
+		environment * removing = current;
+		current = current->parent;
+		if (current == NULL)
+		{
+			finished = true;
+			return;
+		}
+
+		current_thread->current = current;
+
+		bool switching = false;
+		if (removing->has_result)
+		{
+			assert(current != NULL && removing->variables.length > 0);
+			// the result can be taken unless something still sees the environment
+			if (removing->ref_count == 1)
+				current->stack.push_back(std::move(removing->variables.at[0]));
+			else
+				current->stack.push_back(removing->variables.at[0]);
+		}
+		else if (removing->sub->kind == script_engine::bk_microthread)
+		{
+			thread * finishing = current_thread;
+			yield();
+			dispose_thread(finishing);
+			switching = true;
+		}
+
+		assert(removing->stack.length == 0);
+
+		for (;;)
+		{
+			--(removing->ref_count);
+			if (removing->ref_count > 0)
+				break;
+			environment * next = removing->parent;
+			if (removing->frame)
+				dispose_frame(removing);
+			else
+				dispose_environment(removing);
+			removing = next;
 		}
+
+		if (switching)
+			return;
+		goto reload;
 	}
+
+#undef COUNT_CODE
+#undef DISPATCH_CASE
+#undef DISPATCH_NEXT
+#undef SAVE_IP
+#undef LOAD_IP
+#undef BINARY_OPERATION
+#undef UNARY_OPERATION
+#undef ASSIGN_VARIABLE
+#undef COMPARISON
 }
\ No newline at end of file
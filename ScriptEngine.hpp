@@ -13,24 +13,106 @@
 #include<string>
 #include<map>
 #include<unordered_map>
+#include<iosfwd>
+#include<cstddef>
+#include<new>
+#include<utility>
+#include<limits>
 
 // Switch off checks for duplicate identifier declarations
 // #define __SCRIPT_H__NO_CHECK_DUPLICATED
 
+// Choose the floating point type of script reals, real_t if not set
+// #define __SCRIPT_H__REAL_TYPE double
+
+// Switch off the peephole pass, so the machine runs the codes just as the parser wrote them
+// #define __SCRIPT_H__NO_PEEPHOLE
+
+// Count the codes the machine runs, read with script_machine::get_code_count
+// #define __SCRIPT_H__COUNT_CODES
+
 
 // -------- 
 // - General Purpose
 // --------
 namespace gstd
 {
+	// Floating point type of script reals
+#if defined(__SCRIPT_H__REAL_TYPE)
+	typedef __SCRIPT_H__REAL_TYPE real_t;
+#else
+	typedef long double real_t;
+#endif
+
 	// Conversions between string types
 	std::string to_mbcs(std::wstring const & s);
 	std::wstring to_wide(std::string const & s);
 
+	// Class definition for script_allocator
+	// Supplies the memory of value bodies and machine environments, with the variables and stacks of environments
+	// Each script_type_manager has its own, so nothing is shared between managers used on different threads
+	class script_allocator
+	{
+	public:
+
+		// Use the default destructor
+		virtual ~script_allocator()
+		{
+		}
+
+		// Get a block of at least size bytes
+		virtual void * allocate(std::size_t size) = 0;
+
+		// Give back a block obtained from allocate with the same size
+		virtual void deallocate(void * p, std::size_t size) = 0;
+	};
+
+	// end script_allocator
+
+
+	// Memory of a lightweight_vector taken from the global heap
+	struct heap_storage
+	{
+		void * allocate_memory(std::size_t size)
+		{
+			return ::operator new(size);
+		}
+
+		void free_memory(void * p, std::size_t)
+		{
+			::operator delete(p);
+		}
+	};
+
+	// Memory of a lightweight_vector taken from the script_allocator given when it is made, or the heap without one
+	struct pooled_storage
+	{
+		script_allocator * allocator;
+
+		pooled_storage(script_allocator * a = NULL) : allocator(a)
+		{
+		}
+
+		void * allocate_memory(std::size_t size)
+		{
+			return (allocator != NULL) ? allocator->allocate(size) : ::operator new(size);
+		}
+
+		void free_memory(void * p, std::size_t size)
+		{
+			if (allocator != NULL)
+				allocator->deallocate(p, size);
+			else
+				::operator delete(p);
+		}
+	};
+
 	// Class definition for lightweight_vector
 	// Allows for efficient concatenations, insertions, and deletions
-	template < typename T >
-	class lightweight_vector
+	// Every slot up to capacity holds a constructed element, so callers may change length directly
+	// Storage supplies the memory, the memory of one vector moves to another with it
+	template < typename T, typename Storage = heap_storage >
+	class lightweight_vector : private Storage
 	{
 	public:
 
@@ -44,27 +126,71 @@ namespace gstd
 		{
 		}
 
+		// Constructor taking memory from storage
+		explicit lightweight_vector(Storage const & storage) : Storage(storage), length(0), capacity(0), at(NULL)
+		{
+		}
+
 		// Copy Constructor
 		lightweight_vector(lightweight_vector const & source);
 
+		// Move Constructor takes the memory block
+		lightweight_vector(lightweight_vector && source) : Storage(source), length(source.length), capacity(source.capacity), at(source.at)
+		{
+			source.length = 0;
+			source.capacity = 0;
+			source.at = NULL;
+		}
+
 		// Destructor frees memory block
 		~lightweight_vector()
 		{
-			if (at != NULL)
-				delete[] at;
+			destroy(at, capacity);
 		}
 
 		// Copy Assignment Operator
 		lightweight_vector & operator = (lightweight_vector const & source);
 
+		// Move Assignment Operator
+		lightweight_vector & operator = (lightweight_vector && source)
+		{
+			if (this != &source)
+			{
+				destroy(at, capacity);
+				Storage::operator = (source);
+				length = source.length;
+				capacity = source.capacity;
+				at = source.at;
+				source.length = 0;
+				source.capacity = 0;
+				source.at = NULL;
+			}
+			return *this;
+		}
+
 		// Allocates more memory
 		void expand();
 
 		// Add an element to the end
 		void push_back(T const & value)
+		{
+			if (length == capacity)
+			{
+				// The value may be one of the elements, take it before they move
+				T copy(value);
+				expand();
+				at[length] = std::move(copy);
+			}
+			else
+				at[length] = value;
+			++length;
+		}
+
+		// Add an element to the end by moving it in
+		void push_back(T && value)
 		{
 			if (length == capacity) expand();
-			at[length] = value;
+			at[length] = std::move(value);
 			++length;
 		}
 
@@ -86,7 +212,7 @@ namespace gstd
 			length = 0;
 			if (at != NULL)
 			{
-				delete[] at;
+				destroy(at, capacity);
 				at = NULL;
 				capacity = 0;
 			}
@@ -127,11 +253,39 @@ namespace gstd
 
 		// Insert an element at position
 		void insert(T * pos, T const & value);
+
+	private:
+
+		// Uninitialized memory for n elements
+		T * allocate(unsigned n)
+		{
+			return static_cast<T *>(Storage::allocate_memory(n * sizeof(T)));
+		}
+
+		// Destroy n elements and free their memory
+		void destroy(T * p, unsigned n)
+		{
+			if (p == NULL) return;
+			for (unsigned i = 0; i < n; ++i)
+				p[i].~T();
+			Storage::free_memory(p, n * sizeof(T));
+		}
+
+		// Copy constructs the elements of source, the rest of the capacity is default constructed
+		void construct_from(lightweight_vector const & source)
+		{
+			at = allocate(capacity);
+			unsigned i = 0;
+			for (; i < length; ++i)
+				new (&at[i]) T(source.at[i]);
+			for (; i < capacity; ++i)
+				new (&at[i]) T();
+		}
 	};
 
 	// Copy Constructor Definition
-	template < typename T >
-	lightweight_vector < T >::lightweight_vector(lightweight_vector const & source)
+	template < typename T, typename Storage >
+	lightweight_vector < T, Storage >::lightweight_vector(lightweight_vector const & source) : Storage(source)
 	{
 		// Copy fields
 		length = source.length;
@@ -140,9 +294,7 @@ namespace gstd
 		// Copy each element
 		if (source.capacity > 0)
 		{
-			at = new T[source.capacity];
-			for (int i = length - 1; i >= 0; --i)
-				at[i] = source.at[i];
+			construct_from(source);
 		}
 		else // Source is empty
 		{
@@ -151,11 +303,13 @@ namespace gstd
 	}
 
 	// Copy Assignment Operator Definition
-	template < typename T >
-	lightweight_vector < T > & lightweight_vector < T >::operator = (lightweight_vector < T > const & source)
+	template < typename T, typename Storage >
+	lightweight_vector < T, Storage > & lightweight_vector < T, Storage >::operator = (lightweight_vector const & source)
 	{
+		if (this == &source) return *this;
+
 		// Replace current data
-		if (at != NULL) delete[] at;
+		destroy(at, capacity);
 
 		// Copy fields
 		length = source.length;
@@ -164,9 +318,7 @@ namespace gstd
 		// Copy each element into reallocated memory
 		if (source.capacity > 0)
 		{
-			at = new T[source.capacity];
-			for (int i = length - 1; i >= 0; --i)
-				at[i] = source.at[i];
+			construct_from(source);
 		}
 		else // Source is empty
 		{
@@ -177,45 +329,39 @@ namespace gstd
 	}
 
 	// Expand Definition
-	template < typename T >
-	void lightweight_vector < T >::expand()
+	template < typename T, typename Storage >
+	void lightweight_vector < T, Storage >::expand()
 	{
-		// Default capacity of 4
-		if (capacity == 0)
-		{
-			//delete[] at;
-			capacity = 4;
-			at = new T[4];
-		}
-		else // Contents exist
-		{
-			// Recreate buffer with double capacity
-			capacity *= 2;
-			T * n = new T[capacity];
-			// Copy old contents and free old memory
-			for (int i = length - 1; i >= 0; --i)
-				n[i] = at[i];
-			delete[] at;
-			// Point to new array
-			at = n;
-		}
+		// Default capacity of 4, otherwise recreate buffer with double capacity
+		unsigned old_capacity = capacity;
+		capacity = (capacity == 0) ? 4 : capacity * 2;
+		T * n = allocate(capacity);
+		// Move old contents over and free old memory
+		unsigned i = 0;
+		for (; i < length; ++i)
+			new (&n[i]) T(std::move(at[i]));
+		for (; i < capacity; ++i)
+			new (&n[i]) T();
+		destroy(at, old_capacity);
+		// Point to new array
+		at = n;
 	}
 
 	// Erase Definition
-	template < typename T >
-	void lightweight_vector < T >::erase(T * pos)
+	template < typename T, typename Storage >
+	void lightweight_vector < T, Storage >::erase(T * pos)
 	{
 		// Shift out element at pos
 		--length;
 		for (T * i = pos; i < at + length; ++i)
 		{
-			*i = *(i + 1);
+			*i = std::move(*(i + 1));
 		}
 	}
 
 	// Insert Definition
-	template < typename T >
-	void lightweight_vector < T >::insert(T * pos, T const & value)
+	template < typename T, typename Storage >
+	void lightweight_vector < T, Storage >::insert(T * pos, T const & value)
 	{
 		// Expand if necessary
 		if (length == capacity)
@@ -227,7 +373,7 @@ namespace gstd
 		// Shift over to make space for new value at pos
 		for (T * i = at + length; i > pos; --i)
 		{
-			*i = *(i - 1);
+			*i = std::move(*(i - 1));
 		}
 		*pos = value;
 		++length;
@@ -236,10 +382,49 @@ namespace gstd
 	// end lightweight_vector
 
 
+	// Class definition for slab_allocator
+	// Default script_allocator: blocks up to the largest class are carved from slabs and kept until the allocator goes
+	// Each size class keeps a singly linked free list threaded through the freed blocks
+	class slab_allocator : public script_allocator
+	{
+	public:
+		slab_allocator();
+
+		// Slabs go back to the heap, nothing may hold a block by then
+		~slab_allocator();
+
+		void * allocate(std::size_t size);
+		void deallocate(void * p, std::size_t size);
+
+	private:
+		slab_allocator(slab_allocator const & source);
+		slab_allocator & operator = (slab_allocator const & source);
+
+		static std::size_t const granularity = 16;
+		static std::size_t const classes = 16;
+		static std::size_t const slab_size = 64 * 1024;
+
+		struct free_block
+		{
+			free_block * next;
+		};
+
+		free_block * free_blocks[classes];
+		lightweight_vector < void * > slabs;
+
+		// Carve a new slab into blocks of one size class
+		void refill(std::size_t c);
+	};
+
+	// end slab_allocator
+
+
 	// --------
 	// - Start of definitions necessary for scripting engine
 	// --------
 
+	class shape;
+
 	// Class definition for type_data
 	// Stores a type definition to define behaviour for generic values
 	class type_data
@@ -253,12 +438,13 @@ namespace gstd
 		};
 
 		// Constructor
-		type_data(type_kind k, type_data * t = NULL) : kind(k), element(t)
+		type_data(type_kind k, type_data * t = NULL) : kind(k), element(t), array(NULL), layout(NULL), allocator(NULL)
 		{
 		}
 
 		// Copy Constructor
-		type_data(type_data const & source) : kind(source.kind), element(source.element)
+		type_data(type_data const & source) : kind(source.kind), element(source.element), array(source.array), layout(source.layout),
+			allocator(source.allocator)
 		{
 		}
 
@@ -276,42 +462,282 @@ namespace gstd
 			return element;
 		}
 
+		// Gets the layout new objects of this type start with
+		shape * get_layout()
+		{
+			return layout;
+		}
+
+		// Gets the allocator of the manager that made this type
+		script_allocator * get_allocator()
+		{
+			return allocator;
+		}
+
 	private:
+		friend class script_type_manager;
+
 		type_kind kind;
 		type_data * element;
+		type_data * array;	//the type of arrays of this type, made by script_type_manager the first time it is asked for
+		shape * layout;	//objects: the empty layout, owned by script_type_manager
+		script_allocator * allocator;	//memory of the bodies of values of this type, the one of script_type_manager
 	};
 
 	// end type_data
 
 
+	// Class definition for atom_table
+	// Names of variables, routines, events and properties as small integers, so lookups hash and compare integers
+	// Each script_type_manager owns one, next to the shapes whose slots are keyed by its atoms
+	class atom_table
+	{
+	public:
+		atom_table()
+		{
+		}
+
+		// Get the atom of a name, adding the name when it is new
+		unsigned intern(std::wstring const & name)
+		{
+			std::unordered_map<std::wstring, unsigned>::const_iterator i = wide.find(name);
+			if (i != wide.end())
+				return i->second;
+			unsigned atom = names.length;
+			names.push_back(name);
+			wide[name] = atom;
+			return atom;
+		}
+
+		// Names as written in the source, converted only the first time they are seen
+		unsigned intern(std::string const & name)
+		{
+			std::unordered_map<std::string, unsigned>::const_iterator i = narrow.find(name);
+			if (i != narrow.end())
+				return i->second;
+			unsigned atom = intern(to_wide(name));
+			narrow[name] = atom;
+			return atom;
+		}
+
+		// Get the atom of a name without adding it, or -1 when no name was interned that way
+		int find(std::wstring const & name) const
+		{
+			std::unordered_map<std::wstring, unsigned>::const_iterator i = wide.find(name);
+			return (i != wide.end()) ? static_cast < int > (i->second) : -1;
+		}
+
+		int find(std::string const & name) const
+		{
+			std::unordered_map<std::string, unsigned>::const_iterator i = narrow.find(name);
+			return (i != narrow.end()) ? static_cast < int > (i->second) : find(to_wide(name));
+		}
+
+		// Get the name of an atom
+		std::wstring name(unsigned atom) const
+		{
+			return names.at[atom];
+		}
+
+	private:
+		atom_table(atom_table const & source);
+		atom_table & operator = (atom_table const & source);
+
+		lightweight_vector<std::wstring> names;
+		std::unordered_map<std::wstring, unsigned> wide;
+		std::unordered_map<std::string, unsigned> narrow;
+	};
+
+	// end atom_table
+
+
+	// Class definition for shape
+	// Shared layout of object properties
+	// Objects that gained the same properties in the same order share one shape, so a property has the same slot in all of them
+	class shape
+	{
+	public:
+
+		// Constructor for the layout without properties
+		shape()
+		{
+		}
+
+		// Destructor frees every layout reached from this one
+		~shape()
+		{
+			for (std::unordered_map<unsigned, shape *>::iterator i = transitions.begin(); i != transitions.end(); ++i)
+				delete i->second;
+		}
+
+		// Get the slot of a property by the atom of its name, or -1 if it is not in the layout
+		int find(unsigned atom) const
+		{
+			std::unordered_map<unsigned, unsigned>::const_iterator i = slots.find(atom);
+			return (i != slots.end()) ? static_cast < int > (i->second) : -1;
+		}
+
+		// Get the layout with one more property, made once and then shared
+		shape * add(unsigned atom)
+		{
+			shape * & result = transitions[atom];
+			if (result == NULL)
+			{
+				result = new shape();
+				result->slots = slots;
+				result->slots[atom] = slots.size();
+			}
+			return result;
+		}
+
+	private:
+		shape(shape const & source);
+		shape & operator = (shape const & source);
+
+		std::unordered_map<unsigned, unsigned> slots;
+		std::unordered_map<unsigned, shape *> transitions;
+	};
+
+	// end shape
+
+
 	// Class definition for value
 	// Generic dynamically typed data structure
 	// Serves as the fundamental type for the language
+	// Reals, characters and booleans are stored immediately inside the value
+	// Arrays and objects are stored in a shared reference counted body
 	class value
 	{
 	private:
 
-		// Store object-oriented data as a map
-		typedef std::unordered_map<std::wstring, value> object;
+		// Storage used by the elements of an array
+		// Arrays of characters and arrays of reals keep their elements packed until an element of another type is stored
+		enum packing
+		{
+			pk_values, pk_characters, pk_reals
+		};
 
-		// Structure to hold the data for the value
+		// Structure to hold the data for arrays and objects
+		// Objects keep their properties in array_value, at the slots given by their shape
 		struct body
 		{
+			// Bodies come from the allocator of the type of their values
+			static void * operator new(std::size_t size, script_allocator * a)
+			{
+				return a->allocate(size);
+			}
+
+			// Only called when a constructor throws
+			static void operator delete(void * p, script_allocator * a)
+			{
+				a->deallocate(p, sizeof(body));
+			}
+
+			// Destroy a body made with the same allocator
+			static void destroy(body * b, script_allocator * a)
+			{
+				b->~body();
+				a->deallocate(b, sizeof(body));
+			}
+
 			int ref_count;
-			type_data * type;
+			packing packed;
 			lightweight_vector<value> array_value;
+			std::wstring string_value;
+			lightweight_vector<real_t> real_value;
+			shape * layout;
+		};
 
-			union // Use at most one type at a time
-			{
-				object * object_value; // Allow objects to pass by reference
-				long double real_value;
-				wchar_t char_value;
-				bool boolean_value;
-			};
+		// Use at most one member at a time, chosen by the type kind
+		union storage
+		{
+			body * data; // Arrays and objects only
+			real_t real_value;
+			long long integer_value; // Reals holding a whole number
+			wchar_t char_value;
+			bool boolean_value;
 		};
 
-		// Use a pointer, so we can copy only if needed
-		mutable	body * data;
+		// Type of the value, NULL for no data
+		type_data * type;
+
+		// Set while a real is held in integer_value, never set for other types
+		bool integer;
+
+		// Use a pointer for boxed data, so we can copy only if needed
+		mutable storage contents;
+
+		// Check if the value uses a heap body
+		bool is_boxed() const
+		{
+			return type != NULL && type->get_kind() >= type_data::tk_array;
+		}
+
+		// Add a reference to the body if needed
+		void retain() const
+		{
+			if (is_boxed())
+				++(contents.data->ref_count);
+		}
+
+		// Remove a reference from the body and call garbage cleanup if needed
+		void release()
+		{
+			if (is_boxed())
+			{
+				--(contents.data->ref_count);
+				if (contents.data->ref_count == 0)
+					body::destroy(contents.data, type->get_allocator());
+			}
+		}
+
+		// Create a new empty body for arrays and objects
+		void allocate(type_data * t)
+		{
+			type = t;
+			integer = false;
+			contents.data = new (t->get_allocator()) body;
+			contents.data->ref_count = 1;
+			contents.data->packed = packing_of(t);
+			contents.data->layout = NULL;
+		}
+
+		// Choose the storage for the elements of an array type
+		static packing packing_of(type_data * t)
+		{
+			if (t->get_kind() == type_data::tk_array)
+			{
+				switch (t->get_element()->get_kind())
+				{
+				case type_data::tk_char:
+					return pk_characters;
+				case type_data::tk_real:
+					return pk_reals;
+				default:
+					break;
+				}
+			}
+			return pk_values;
+		}
+
+		// Expand packed elements into element values
+		void unpack() const
+		{
+			body * b = contents.data;
+			if (b->packed == pk_characters)
+			{
+				for (unsigned i = 0; i < b->string_value.size(); ++i)
+					b->array_value.push_back(value(type->get_element(), b->string_value[i]));
+				b->string_value.clear();
+			}
+			else if (b->packed == pk_reals)
+			{
+				for (unsigned i = 0; i < b->real_value.length; ++i)
+					b->array_value.push_back(value(type->get_element(), b->real_value.at[i]));
+				b->real_value.release();
+			}
+			b->packed = pk_values;
+		}
 
 
 	public:
@@ -319,123 +745,119 @@ namespace gstd
 		// Constructors
 
 		// Default Constructor with no data
-		value() : data(NULL)
+		// The storage is zeroed so copies of empty values never read it uninitialized
+		value() : type(NULL), integer(false), contents()
 		{
 		}
 
 		// Construct as an empty object
-		value(type_data * t)
+		value(type_data * t) : type(NULL), integer(false), contents()
 		{
 			if (t->get_kind() == type_data::tk_object)
 			{
-				data = new body;
-				data->ref_count = 1;
-				data->type = t;
-				data->object_value = new object();
+				allocate(t);
+				contents.data->layout = t->get_layout();
 			}
-			else
-				data = NULL;
 		}
 
 		// Construct as a number
-		value(type_data * t, long double v)
+		value(type_data * t, real_t v) : type(t), integer(false)
 		{
-			data = new body;
-			data->ref_count = 1;
-			data->type = t;
-			data->real_value = v;
+			contents.real_value = v;
+		}
+
+		// Construct as a number held as an integer, v must be within integer_limit
+		value(type_data * t, long long v) : type(t), integer(true)
+		{
+			contents.integer_value = v;
 		}
 
 		// Construct as a character
-		value(type_data * t, wchar_t v)
+		value(type_data * t, wchar_t v) : type(t), integer(false)
 		{
-			data = new body;
-			data->ref_count = 1;
-			data->type = t;
-			data->char_value = v;
+			contents.char_value = v;
 		}
 
 		// Construct as a boolean
-		value(type_data * t, bool v)
+		value(type_data * t, bool v) : type(t), integer(false)
 		{
-			data = new body;
-			data->ref_count = 1;
-			data->type = t;
-			data->boolean_value = v;
+			contents.boolean_value = v;
 		}
 
 		// Construct as a string
-		value(type_data * t, std::wstring v)
+		value(type_data * t, std::wstring const & v) : integer(false)
 		{
-			data = new body();
-			data->ref_count = 1;
-			data->type = t;
-			for (unsigned i = 0; i < v.size(); ++i)
-				data->array_value.push_back(value(t->get_element(), v[i]));
+			allocate(t);
+			if (contents.data->packed == pk_characters)
+				contents.data->string_value = v;
+			else if (!v.empty())
+			{
+				unpack();
+				for (unsigned i = 0; i < v.size(); ++i)
+					contents.data->array_value.push_back(value(t->get_element(), v[i]));
+			}
 		}
 
 		// Copy Constructor adds a reference to source data
-		value(value const & source)
+		value(value const & source) : type(source.type), integer(source.integer), contents(source.contents)
 		{
-			data = source.data;
-			if (data != NULL)
-				++(data->ref_count);
+			retain();
+		}
+
+		// Move Constructor takes the source data without touching its reference count
+		value(value && source) : type(source.type), integer(source.integer), contents(source.contents)
+		{
+			source.type = NULL;
+			source.integer = false;
 		}
 
 		// Destructor calls garbage cleanup if needed
 		~value()
 		{
-			if (data != NULL)
-			{
-				--(data->ref_count);
-				if (data->ref_count == 0)
-				{
-					if (data->type->get_kind() == type_data::tk_object)
-						delete data->object_value;
-					delete data;
-				}
-			}
+			release();
 		}
 
 		// Copy Assignment Operator
 		value & operator = (value const & source)
 		{
 			// Add reference if source exists
-			if (source.data != NULL)
-				++(source.data->ref_count);
+			source.retain();
 
 			// Check for garbage cleanup on current data
-			if (data != NULL)
-			{
-				--(data->ref_count);
-				if (data->ref_count == 0) 
-				{
-					if (data->type->get_kind() == type_data::tk_object)
-						delete data->object_value;
-					delete data;
-				}
-			}
+			release();
+
+			type = source.type;
+			integer = source.integer;
+			contents = source.contents;
+			return *this;
+		}
+
+		// Move Assignment Operator
+		// The source is emptied before the old data goes, in case it lives inside that data
+		value & operator = (value && source)
+		{
+			type_data * t = source.type;
+			bool i = source.integer;
+			storage c = source.contents;
+			source.type = NULL;
+			source.integer = false;
+
+			release();
 
-			data = source.data;
+			type = t;
+			integer = i;
+			contents = c;
 			return *this;
 		}
 
 		// Transforms a reference value into a unique copy
 		void unique() const
 		{
-			if (data == NULL)
+			if (is_boxed() && contents.data->ref_count > 1)
 			{
-				data = new body;
-				data->ref_count = 1;
-				data->type = NULL;
-			}
-			else if (data->ref_count > 1)
-			{
-				--(data->ref_count);
-				data = new body(*data);
-				data->ref_count = 1;
-				if (data->type->get_kind() == type_data::tk_object)
-					data->object_value = new object(*data->object_value);
+				--(contents.data->ref_count);
+				contents.data = new (type->get_allocator()) body(*contents.data);
+				contents.data->ref_count = 1;
 			}
 		}
 
@@ -444,65 +866,90 @@ namespace gstd
 		// Check for null value
 		bool has_data() const
 		{
-			return data != NULL;
+			return type != NULL;
 		}
 
 		// Gets the value type
 		type_data * get_type() const
 		{
 
-			return data->type;
+			return type;
 		}
 
 		// Set to a number
-		void set(type_data * t, long double v)
+		void set(type_data * t, real_t v)
 		{
-			unique();
-			data->type = t;
-			data->real_value = v;
+			release();
+			type = t;
+			integer = false;
+			contents.real_value = v;
+		}
+
+		// Set to a number held as an integer, v must be within integer_limit
+		void set(type_data * t, long long v)
+		{
+			release();
+			type = t;
+			integer = true;
+			contents.integer_value = v;
+		}
+
+		// Replace the number of a value that holds a real, v must be within integer_limit
+		void set_number(long long v)
+		{
+			integer = true;
+			contents.integer_value = v;
 		}
 
 		// Set to a boolean
 		void set(type_data * t, bool v)
 		{
-			unique();
-			data->type = t;
-			data->boolean_value = v;
+			release();
+			type = t;
+			integer = false;
+			contents.boolean_value = v;
 		}
 
 		// Object functions
 
+		// Properties are named by atoms of the atom_table of the type manager that made the object type
+
 		// Register a new property and check for failure
-		bool register_property(const std::wstring & name, const value & val)
+		bool register_property(unsigned atom, const value & val)
 		{
 			unique();
-			if (data->type->get_kind() == type_data::tk_object)
-				return std::get<1>(data->object_value->try_emplace(name, val));
+			if (type->get_kind() == type_data::tk_object && contents.data->layout->find(atom) < 0)
+			{
+				contents.data->layout = contents.data->layout->add(atom);
+				contents.data->array_value.push_back(val);
+				return true;
+			}
 
 			return false;
 		}
 
-		// Access a property by name and return null on failure
-		const value get_property(const std::wstring & name) const
+		// Access a property and return null on failure, -1 stands for a name without an atom
+		const value get_property(int atom) const
 		{
-			if (data->type->get_kind() == type_data::tk_object) 
+			if (type->get_kind() == type_data::tk_object && atom >= 0)
 			{
-				if (data->object_value->count(name) != 0)
-					return data->object_value->at(name);
+				int i = contents.data->layout->find(atom);
+				if (i >= 0)
+					return contents.data->array_value.at[i];
 			}
 
 			return value();
 		}
 
 		// Attempt to overwrite a property and check for failure
-		bool set_property(const std::wstring & name, const value & val)
+		bool set_property(int atom, const value & val)
 		{
-
-			if (data->type->get_kind() == type_data::tk_object && val.has_data()) 
+			if (type->get_kind() == type_data::tk_object && val.has_data() && atom >= 0)
 			{
-				if (data->object_value->at(name).get_type() == val.get_type()) 
+				int i = contents.data->layout->find(atom);
+				if (i >= 0 && contents.data->array_value.at[i].get_type() == val.get_type()) 
 				{
-					data->object_value->at(name) = val;
+					contents.data->array_value.at[i] = val;
 					return true;
 				}
 			}
@@ -510,6 +957,25 @@ namespace gstd
 			return false;
 		}
 
+		// Get the shape of an object, or NULL for any other value
+		shape * get_shape() const
+		{
+			return (type != NULL && type->get_kind() == type_data::tk_object) ? contents.data->layout : NULL;
+		}
+
+		// Access a property by its slot in the shape
+		value const & get_slot(unsigned i) const
+		{
+			return contents.data->array_value.at[i];
+		}
+
+		// Overwrite a property by its slot in the shape
+		// Objects pass by reference, so the write is seen through every copy
+		void set_slot(unsigned i, value const & val) const
+		{
+			contents.data->array_value.at[i] = val;
+		}
+
 		// end Object functions
 
 
@@ -518,47 +984,165 @@ namespace gstd
 		// Add an element to the end of the array
 		void append(type_data * t, value const & x)
 		{
+			if (!is_boxed())
+				allocate(t);
 			unique();
-			data->type = t;
-			data->array_value.push_back(x);
+			body * b = contents.data;
+			packing p = packing_of(t);
+			if (length_as_array() == 0)
+				b->packed = p;	// An empty array takes the storage of its new type
+			if (b->packed == pk_characters && p == pk_characters)
+				b->string_value += x.as_char();
+			else if (b->packed == pk_reals && p == pk_reals && x.type == t->get_element())
+				b->real_value.push_back(x.get_real());
+			else
+			{
+				unpack();
+				b->array_value.push_back(x);
+			}
+			type = t;
 		}
 
 		// Concatenate two arrays together
 		void concatenate(value const & x)
 		{
 			unique();
-			unsigned l = data->array_value.length;
-			unsigned r = x.data->array_value.length;
-			unsigned t = l + r;
-			if (l == 0)
-				data->type = x.data->type;
-			while (data->array_value.capacity < t)
-				data->array_value.expand();
-			for (unsigned i = 0; i < r; ++i)
-				data->array_value[l + i] = x.data->array_value.at[i];
-			data->array_value.length = t;
+			body * b = contents.data;
+			body * xb = x.contents.data;
+			if (length_as_array() == 0)
+			{
+				// An empty array takes the type and the representation of the other one
+				type = x.type;
+				b->array_value.length = 0;
+				b->string_value.clear();
+				b->real_value.length = 0;
+				b->packed = xb->packed;
+			}
+			else if (x.length_as_array() == 0)
+				return;
+
+			if (b->packed == pk_characters && xb->packed == pk_characters)
+				b->string_value += xb->string_value;
+			else if (b->packed == pk_reals && xb->packed == pk_reals)
+			{
+				for (unsigned i = 0; i < xb->real_value.length; ++i)
+					b->real_value.push_back(xb->real_value.at[i]);
+			}
+			else if (xb->packed != pk_values)
+			{
+				unpack();
+				unsigned r = x.length_as_array();
+				for (unsigned i = 0; i < r; ++i)
+					b->array_value.push_back(x.index_as_array(i));
+			}
+			else if (b->packed == pk_characters)
+			{
+				for (unsigned i = 0; i < xb->array_value.length; ++i)
+					b->string_value += xb->array_value.at[i].as_char();
+			}
+			else
+			{
+				unpack();
+				unsigned l = b->array_value.length;
+				unsigned r = xb->array_value.length;
+				unsigned t = l + r;
+				while (b->array_value.capacity < t)
+					b->array_value.expand();
+				for (unsigned i = 0; i < r; ++i)
+					b->array_value[l + i] = xb->array_value.at[i];
+				b->array_value.length = t;
+			}
 		}
 
 		// Get the array length
 		unsigned length_as_array() const
 		{
-			return data->array_value.size();
+			switch (contents.data->packed)
+			{
+			case pk_characters:
+				return contents.data->string_value.size();
+			case pk_reals:
+				return contents.data->real_value.length;
+			default:
+				return contents.data->array_value.length;
+			}
 		}
 
 		// Get read-only index of array
-		value const & index_as_array(unsigned i) const
+		// Elements of packed arrays are made on demand
+		value index_as_array(unsigned i) const
 		{
-			if (data != NULL)
-				++(data->ref_count);
-			return data->array_value[i];
+			switch (contents.data->packed)
+			{
+			case pk_characters:
+				return value(type->get_element(), contents.data->string_value[i]);
+			case pk_reals:
+				return value(type->get_element(), contents.data->real_value.at[i]);
+			default:
+				return contents.data->array_value[i];
+			}
 		}
 
 		// Get writable index of array
-		value & index_as_array(unsigned i)
+		// Writes go directly into the body shared by every reference
+		value & index_as_array_writable(unsigned i) const
+		{
+			unpack();
+			return contents.data->array_value[i];
+		}
+
+		// Overwrite an element in place
+		// Writes go directly into the body shared by every reference, packed storage is kept while the element fits it
+		void assign_as_array(unsigned i, value const & x) const
+		{
+			body * b = contents.data;
+			if (b->packed == pk_characters && x.type == type->get_element())
+				b->string_value[i] = x.contents.char_value;
+			else if (b->packed == pk_reals && x.type == type->get_element())
+				b->real_value.at[i] = x.get_real();
+			else
+			{
+				unpack();
+				b->array_value.at[i] = x;
+			}
+		}
+
+		// Compare two arrays of characters, both must be packed
+		int compare_as_string(value const & x) const
+		{
+			int r = contents.data->string_value.compare(x.contents.data->string_value);
+			return (r == 0) ? 0 : (r < 0) ? -1 : 1;
+		}
+
+		// Check if the value is an array with packed characters
+		bool is_packed_string() const
+		{
+			return type != NULL && type->get_kind() == type_data::tk_array && contents.data->packed == pk_characters;
+		}
+
+		// Check if the value is an array with packed reals
+		bool is_packed_reals() const
+		{
+			return type != NULL && type->get_kind() == type_data::tk_array && contents.data->packed == pk_reals;
+		}
+
+		// Contiguous elements of an array with packed reals
+		real_t const * packed_reals() const
+		{
+			return contents.data->real_value.at;
+		}
+
+		// Construct as an array of packed reals for an element-wise kernel to fill
+		static value make_packed_reals(type_data * t, unsigned n, real_t * & elements)
 		{
-			if (data != NULL)
-				++(data->ref_count);
-			return data->array_value[i];
+			value result;
+			result.allocate(t);
+			lightweight_vector<real_t> & v = result.contents.data->real_value;
+			while (v.capacity < n)
+				v.expand();
+			v.length = n;
+			elements = v.at;
+			return result;
 		}
 
 		// end Array functions
@@ -568,28 +1152,58 @@ namespace gstd
 		// All return an existing C++ data type
 		// TODO: Some of these are somewhat confusing, changes pending
 
+		// Whole numbers up to this magnitude are exact in real_t, so they may be held as integers
+		static long long const integer_limit = 1LL << ((std::numeric_limits < real_t >::digits < 53) ? std::numeric_limits < real_t >::digits : 53);
+
+		// Construct as a number, held as an integer when it is whole and within integer_limit
+		// Negative zero stays a real so that its sign is kept
+		static value make_number(type_data * t, real_t v)
+		{
+			if (v >= -integer_limit && v <= integer_limit && v == static_cast < long long > (v) && (v != 0 || 1 / v > 0))
+				return value(t, static_cast < long long > (v));
+			return value(t, v);
+		}
+
+		// Check if the value is a real held as an integer
+		bool is_integer() const
+		{
+			return integer;
+		}
+
+		// As an integer, for callers that already know the value is held as one
+		long long get_integer() const
+		{
+			return contents.integer_value;
+		}
+
+		// As a number, for callers that already know the value is a real
+		real_t get_real() const
+		{
+			return integer ? static_cast < real_t > (contents.integer_value) : contents.real_value;
+		}
+
 		// As a number
-		long double as_real() const
+		real_t as_real() const
 		{
-			if (data == NULL)
-				return 0.0L;
+			if (type == NULL)
+				return 0;
 			else
 			{
-				switch (data->type->get_kind())
+				switch (type->get_kind())
 				{
 				case type_data::tk_real:
-					return data->real_value;
+					return get_real();
 				case type_data::tk_char:
-					return static_cast < long double > (data->char_value);
+					return static_cast < real_t > (contents.char_value);
 				case type_data::tk_boolean:
-					return (data->boolean_value) ? 1.0L : 0.0L;
+					return (contents.boolean_value) ? 1 : 0;
 				case type_data::tk_array:
-					if (data->type->get_element()->get_kind() == type_data::tk_char)
+					if (type->get_element()->get_kind() == type_data::tk_char)
 						return std::atof(to_mbcs(as_string()).c_str());
 					else
-						return 0.0L;
+						return 0;
 				default:
-					return 0.0L;
+					return 0;
 				}
 			}
 		}
@@ -597,18 +1211,18 @@ namespace gstd
 		// As a character
 		wchar_t as_char() const
 		{
-			if (data == NULL)
-				return 0.0L;
+			if (type == NULL)
+				return 0;
 			else
 			{
-				switch (data->type->get_kind())
+				switch (type->get_kind())
 				{
 				case type_data::tk_real:
-					return data->real_value;
+					return get_real();
 				case type_data::tk_char:
-					return data->char_value;
+					return contents.char_value;
 				case type_data::tk_boolean:
-					return (data->boolean_value) ? L'1' : L'0';
+					return (contents.boolean_value) ? L'1' : L'0';
 				case type_data::tk_array:
 					return L'\0';
 				default:
@@ -620,20 +1234,20 @@ namespace gstd
 		// As a boolean
 		bool as_boolean() const
 		{
-			if (data == NULL)
+			if (type == NULL)
 				return false;
 			else
 			{
-				switch (data->type->get_kind())
+				switch (type->get_kind())
 				{
 				case type_data::tk_real:
-					return data->real_value != 0.0L;
+					return get_real() != 0;
 				case type_data::tk_char:
-					return data->char_value != L'\0';
+					return contents.char_value != L'\0';
 				case type_data::tk_boolean:
-					return data->boolean_value;
+					return contents.boolean_value;
 				case type_data::tk_array:
-					return data->array_value.size() != 0;
+					return length_as_array() != 0;
 				default:
 					return false;
 				}
@@ -643,22 +1257,23 @@ namespace gstd
 		// As a string
 		std::wstring as_string() const
 		{
-			if (data == NULL)
+			if (type == NULL)
 				return L"(VOID)";
 
 			else
 			{
-				switch (data->type->get_kind())
+				switch (type->get_kind())
 				{
 				case type_data::tk_real:
 				{
 					wchar_t buffer[128];
-					long double isInt;
-					if (modf(data->real_value, &isInt) == 0.0) {
-						std::swprintf(buffer, L"%d", static_cast < int > (data->real_value));
+					real_t r = get_real();
+					real_t isInt;
+					if (modf(r, &isInt) == 0) {
+						std::swprintf(buffer, L"%d", static_cast < int > (r));
 					}
 					else {
-						std::swprintf(buffer, L"%Lf", data->real_value);
+						std::swprintf(buffer, L"%Lf", static_cast < long double > (r));
 					}
 					return std::wstring(buffer);
 				}
@@ -666,30 +1281,33 @@ namespace gstd
 				case type_data::tk_char:
 				{
 					std::wstring result;
-					result += data->char_value;
+					result += contents.char_value;
 					return result;
 				}
 
 				case type_data::tk_boolean:
-					return (data->boolean_value) ? L"true" : L"false";
+					return (contents.boolean_value) ? L"true" : L"false";
 
 				case type_data::tk_array:
 				{
 
-					if (data->type->get_element()->get_kind() == type_data::tk_char)
+					if (contents.data->packed == pk_characters)
+						return contents.data->string_value;
+					else if (type->get_element()->get_kind() == type_data::tk_char)
 					{
 						std::wstring result;
-						for (unsigned i = 0; i < data->array_value.size(); ++i)
-							result += data->array_value[i].as_char();
+						for (unsigned i = 0; i < contents.data->array_value.size(); ++i)
+							result += contents.data->array_value[i].as_char();
 						return result;
 					}
 					else
 					{
 						std::wstring result = L"[";
-						for (unsigned i = 0; i < data->array_value.size(); ++i)
+						unsigned n = length_as_array();
+						for (unsigned i = 0; i < n; ++i)
 						{
-							result += data->array_value[i].as_string();
-							if (i != data->array_value.size() - 1)
+							result += index_as_array(i).as_string();
+							if (i != n - 1)
 								result += L",";
 						}
 						result += L"]";
@@ -709,14 +1327,6 @@ namespace gstd
 
 		// end implicit conversions
 
-
-		//danger! called from the outside
-		void overwrite(value const & source)
-		{
-			*data = *source.data;
-			++(data->ref_count);
-		}
-
 	};
 
 	// end value definition
@@ -743,14 +1353,33 @@ namespace gstd
 		type_data * boolean_type;
 		type_data * string_type;
 		type_data * object_type;
+		shape empty_layout;	//shapes of objects and the atoms naming their properties go away with the manager
+		atom_table atoms;
+		slab_allocator slabs;
+		script_allocator * allocator;	//the slabs unless the host gave its own
+
+		script_type_manager(script_type_manager const & source);
+		script_type_manager & operator = (script_type_manager const & source);
+
+		type_data * add_type(type_data::type_kind kind, type_data * element = NULL)
+		{
+			type_data * result = &* types.insert(types.end(), type_data(kind, element));
+			result->allocator = allocator;
+			return result;
+		}
+
 	public:
-		script_type_manager()
+		// Values, engines and machines of the manager take their memory from an_allocator, or from slabs of the manager
+		// Every one of them has to go before the manager, and all of them are used from one thread at a time
+		script_type_manager(script_allocator * an_allocator = NULL) : allocator((an_allocator != NULL) ? an_allocator : &slabs)
 		{
-			real_type = &* types.insert(types.end(), type_data(type_data::tk_real));
-			char_type = &* types.insert(types.end(), type_data(type_data::tk_char));
-			boolean_type = &* types.insert(types.end(), type_data(type_data::tk_boolean));
-			string_type = &* types.insert(types.end(), type_data(type_data::tk_array, char_type));
-			object_type = &* types.insert(types.end(), type_data(type_data::tk_object));
+			real_type = add_type(type_data::tk_real);
+			char_type = add_type(type_data::tk_char);
+			boolean_type = add_type(type_data::tk_boolean);
+			string_type = add_type(type_data::tk_array, char_type);
+			char_type->array = string_type;
+			object_type = add_type(type_data::tk_object);
+			object_type->layout = &empty_layout;
 		}
 
 		type_data * get_real_type()
@@ -773,16 +1402,12 @@ namespace gstd
 			return string_type;
 		}
 
+		// Array types hang off their element type, so each is made once and found without a search
 		type_data * get_array_type(type_data * element)
 		{
-			for (std::list < type_data >::iterator i = types.begin(); i != types.end(); ++i)
-			{
-				if (i->get_kind() == type_data::tk_array && i->get_element() == element)
-				{
-					return &* i;
-				}
-			}
-			return &* types.insert(types.end(), type_data(type_data::tk_array, element));
+			if (element->array == NULL)
+				element->array = add_type(type_data::tk_array, element);
+			return element->array;
 		}
 
 		type_data * get_object_type()
@@ -790,6 +1415,16 @@ namespace gstd
 			return object_type;
 		}
 
+		atom_table & get_atoms()
+		{
+			return atoms;
+		}
+
+		script_allocator * get_allocator()
+		{
+			return allocator;
+		}
+
 	};
 
 	class script_engine
@@ -807,7 +1442,27 @@ namespace gstd
 			pc_assign, pc_assign_writable, pc_break_loop, pc_break_routine, pc_call, pc_call_and_push_result, pc_case_begin,
 			pc_case_end, pc_case_if, pc_case_if_not, pc_case_next, pc_compare_e, pc_compare_g, pc_compare_ge, pc_compare_l,
 			pc_compare_le, pc_compare_ne, pc_dup, pc_dup2, pc_loop_ascent, pc_loop_back, pc_loop_count, pc_loop_descent,
-			pc_loop_if, pc_pop, pc_push_value, pc_push_variable, pc_push_variable_writable, pc_swap, pc_yield, pc_exit
+			pc_loop_if, pc_pop, pc_push_value, pc_push_variable, pc_push_variable_writable, pc_swap, pc_yield, pc_exit,
+			//built-in operators, sub/arguments point to the native function used when the operands are not reals
+			pc_add, pc_subtract, pc_multiply, pc_divide, pc_remainder, pc_power, pc_compare, pc_negative, pc_successor,
+			pc_predecessor, pc_concatenate,
+			//object properties, the code holds the atom of the name and caches the slot found for the last shape seen
+			pc_get_property, pc_set_property,
+			//~= on a variable, level/variable point to it and the appended value is on the stack
+			pc_concatenate_assign,
+			//compound assignment and ++/-- on an array element or a property, operation is the operator code applied
+			pc_modify_element, pc_modify_property,
+			//for loops over a range, the stack holds the bound and the counter, ip of the back codes is the first code
+			pc_range_ascent, pc_range_descent, pc_range_ascent_back, pc_range_descent_back,
+			//closes loop(n) and times: counts down like loop_count and goes back past the loop_count at ip
+			pc_loop_count_back,
+			//let with a value, the variable starts anew so no type check
+			pc_declare,
+			//end of a body inlined into the block around it, empties the slots first_variable.. of its variables
+			pc_clear_variables,
+			//written by the peephole pass: && and || keeping the left operand when it decides, compare with the comparison
+			//in operation, and an assignment to the result followed by leaving the routine
+			pc_and_then, pc_or_else, pc_comparison, pc_return
 		};
 
 		struct block;
@@ -815,8 +1470,11 @@ namespace gstd
 		struct code
 		{
 			command_kind command;
-			int line;	//!!line in the source code
-			value data;	//!!data used to push in pc_push_value
+			union
+			{
+				unsigned constant;	//push_value: index of the value in the constant pool of the engine
+				unsigned atom;	//property codes: name of the property
+			};
 
 			union
 			{
@@ -832,7 +1490,18 @@ namespace gstd
 				};
 				struct
 				{
-					int ip;	//loop_back return destination												 //loop_back̖߂
+					shape * cached_shape;	//get_property/set_property: shape of the last object accessed
+					unsigned cached_slot;	//slot of the property in that shape
+					command_kind operation;	//modify_element/modify_property: operator applied to the element, comparison: compare_e and so on
+				};
+				struct
+				{
+					unsigned first_variable;	//clear_variables: first slot of the body in the current environment
+					unsigned variable_count;	//number of slots from there
+				};
+				struct
+				{
+					int ip;	//loop_back return destination, or jump destination of case_if/case_next and loop exits												 //loop_back̖߂
 				};
 			};
 
@@ -840,24 +1509,21 @@ namespace gstd
 			{
 			}
 
-			code(int the_line, command_kind the_command) : line(the_line), command(the_command)
+			code(command_kind the_command) : command(the_command), constant(0)
 			{
 			}
 
-			code(int the_line, command_kind the_command, int the_level, unsigned the_variable) : line(the_line), command(the_command), level(the_level), variable(the_variable)
+			code(command_kind the_command, int the_level, unsigned the_variable) : command(the_command), constant(0), level(the_level),
+				variable(the_variable)
 			{
 			}
 
-			code(int the_line, command_kind the_command, block * the_sub, int the_arguments) : line(the_line), command(the_command), sub(the_sub),
+			code(command_kind the_command, block * the_sub, int the_arguments) : command(the_command), constant(0), sub(the_sub),
 				arguments(the_arguments)
 			{
 			}
 
-			code(int the_line, command_kind the_command, int the_ip) : line(the_line), command(the_command), ip(the_ip)
-			{
-			}
-
-			code(int the_line, command_kind the_command, value const & the_data) : line(the_line), command(the_command), data(the_data)
+			code(command_kind the_command, int the_ip) : command(the_command), constant(0), ip(the_ip)
 			{
 			}
 		};
@@ -874,16 +1540,34 @@ namespace gstd
 			std::string name;
 			callback func;
 			lightweight_vector<code> codes;
+			lightweight_vector<int> lines;	//source line of each code, read only to report errors
 			block_kind kind;
+			int break_ip;	//loop blocks: ip in the calling block just past the code closing the loop, used by pc_break_loop
+			int variables;	//number of variables declared in the block, reserved when its environment is made
+			bool frame;	//nothing can hold the environment past the call, so it runs on a frame of the thread
+
+			block(int the_level, block_kind the_kind) : level(the_level), arguments(0), name(), func(NULL), codes(), lines(), kind(the_kind),
+				break_ip(0), variables(0), frame(false)
+			{
+			}
 
-			block(int the_level, block_kind the_kind) : level(the_level), arguments(0), name(), func(NULL), codes(), kind(the_kind)
+			void push_code(int line, code const & c)
 			{
+				codes.push_back(c);
+				lines.push_back(line);
 			}
 		};
 
 		std::list <block> blocks;	//g̃|C^ĝŃAhXςȂ悤list //doubly linked list
 		block * main_block;
-		std::map < std::string, block * > events;  //events are those like @Initialize and @MainLoop
+		std::map < unsigned, block * > events;  //events are those like @Initialize and @MainLoop, keyed by the atom of their name
+		lightweight_vector < value > constants;	//literals pushed by push_value, codes hold their index
+
+		unsigned add_constant(value const & v)
+		{
+			constants.push_back(v);
+			return constants.length - 1;
+		}
 
 		block * new_block(int level, block_kind kind)
 		{
@@ -935,6 +1619,11 @@ namespace gstd
 			return type_manager->get_array_type(element);
 		}
 
+		atom_table & get_atoms()
+		{
+			return type_manager->get_atoms();
+		}
+
 		type_data * get_string_type()
 		{
 			return type_manager->get_string_type();
@@ -949,6 +1638,24 @@ namespace gstd
 
 		script_engine(script_type_manager * a_type_manager, std::string const & source, int funcc, function const * funcv);
 
+		// Loads the compiled code from a cache file (.faec) when it matches the source,
+		// otherwise parses the source and rewrites the cache
+		script_engine(script_type_manager * a_type_manager, std::string const & source, int funcc, function const * funcv, std::string const & cache_path);
+
+		// Precompiled code cache
+		// Native functions are stored by name and bound again on load
+		// Loading fails for another source, another engine version, or a missing native function
+		bool save_cache(std::ostream & stream, std::string const & source);
+		bool load_cache(std::istream & stream, std::string const & source, int funcc, function const * funcv);
+
+	private:
+
+		void parse(std::string const & source, int funcc, function const * funcv);
+		void mark_frames();
+		void optimize(block * b);
+
+	public:
+
 		~script_engine()
 		{
 			blocks.clear();
@@ -969,19 +1676,39 @@ namespace gstd
 		std::string error_message;
 		int error_line;
 
-		typedef lightweight_vector < value > variables_t;
-		typedef lightweight_vector < value > stack_t;
+		script_allocator * allocator;	//the one of the type manager of the engine
+
+		typedef lightweight_vector < value, pooled_storage > variables_t;
+		typedef lightweight_vector < value, pooled_storage > stack_t;
 
+		// Environments, their variables and their stacks come from the allocator of the machine
 		struct environment
 		{
+			static void * operator new(std::size_t size, script_allocator * a)
+			{
+				return a->allocate(size);
+			}
+
+			// Only called when the constructor throws
+			static void operator delete(void * p, script_allocator * a)
+			{
+				a->deallocate(p, sizeof(environment));
+			}
+
+			environment(script_allocator * a) : variables(a), stack(a)
+			{
+			}
+
 			environment * pred, *succ;
-			environment * parent;
+			environment * parent;	//caller, or launcher for microthreads
+			lightweight_vector < environment * > display;	//lexically enclosing environments indexed by block level
 			int ref_count;
 			script_engine::block * sub;
 			unsigned ip;
-			variables_t variables; //vector of type value
+			variables_t variables; //vector of type value, keeps its capacity when the environment is reused
 			stack_t stack; //vector of type value
 			bool has_result;
+			bool frame;	//belongs to the frames of its thread instead of the lists below
 		};
 
 		environment * first_using_environment;
@@ -990,19 +1717,74 @@ namespace gstd
 		environment * last_garbage_environment;
 		environment * new_environment(environment * parent, script_engine::block * b);
 		void dispose_environment(environment * object);
+		void free_environment(environment * object);
+		void prepare_environment(environment * result, environment * parent, script_engine::block * b);
+
+		// Threads run in list order from last to first, the main thread is always first
+		// A launched microthread is linked right after its launcher, so spawning and finishing never shift other threads
+		// Sleeping threads leave the list but keep their place in the run order, a second list holding every thread
+		struct thread
+		{
+			thread * pred, *succ;
+			thread * order_pred, *order_succ;	//every thread in run order, sleeping or not
+			environment * current;	//innermost environment running in this thread
+			unsigned long long wake_frame;	//sleeping threads: frame they run again in
+			bool parked;	//sleeping, out of the list yield goes through
+			lightweight_vector < environment * > frames;	//environments for frame blocks, taken and given back in call order
+			unsigned frame_depth;	//frames in use
+
+			thread() : frame_depth(0)
+			{
+			}
+		};
 
-		lightweight_vector < environment * > threads; //a vector of pointers to environments, called threads
-		unsigned current_thread_index;
+		// Sleeping threads in a heap, the one waking first on top
+		struct sleeper
+		{
+			unsigned long long wake_frame;
+			thread * sleeping;
+
+			// Heap order, the earliest frame on top
+			static bool wakes_later(sleeper const & a, sleeper const & b)
+			{
+				return a.wake_frame > b.wake_frame;
+			}
+		};
+
+		thread * first_thread;
+		thread * last_thread;
+		thread * first_garbage_thread;
+		thread * current_thread;
+		lightweight_vector < sleeper > sleepers;
+		thread * new_thread(thread * launcher, environment * e);
+		void dispose_thread(thread * object);
+		void free_thread(thread * object);
+		void park_thread(thread * object);
+		void wake_threads();
+		void wake_all_threads();
+		environment * new_frame(environment * parent, script_engine::block * b);
+		void dispose_frame(environment * object);
 		bool finished;
 		bool stopped;
 		bool resuming;
 
+		// A frame ends each time the run order wraps around past the main thread
+		unsigned long long frame_count;
+		unsigned long long sleep_frames;	//requested by a native function for the current thread
+		unsigned long long code_count;	//codes run, counted only with __SCRIPT_H__COUNT_CODES
+
+		// Threads whose frame has come go back into the list as a new frame starts, at the point of the run order they left
 		void yield()
 		{
-			if (current_thread_index > 0)
-				--current_thread_index;
+			if (current_thread->pred != NULL)
+				current_thread = current_thread->pred;
 			else
-				current_thread_index = threads.size() - 1;
+			{
+				++frame_count;
+				if (sleepers.length > 0 && sleepers.at[0].wake_frame <= frame_count)
+					wake_threads();
+				current_thread = last_thread;
+			}
 		}
 
 		void advance();
@@ -1022,11 +1804,20 @@ namespace gstd
 			stopped = true;
 		}
 
+		// Puts the current microthread to sleep for the given number of frames once the calling native function returns
+		void sleep(unsigned long long frames);
+
 		bool get_stopped()
 		{
 			return stopped;
 		}
 
+		// Codes run since the machine was made, always 0 unless built with __SCRIPT_H__COUNT_CODES
+		unsigned long long get_code_count()
+		{
+			return code_count;
+		}
+
 		bool get_resuming()
 		{
 			return resuming;
@@ -1052,6 +1843,9 @@ namespace gstd
 			error = true;
 			error_message = message;
 			finished = true;
+
+			// The line is looked up only on error, from the code being executed
+			error_line = (current_thread != NULL) ? get_current_line() : -1;
 		}
 
 		script_engine * get_engine()